@@ -0,0 +1,97 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    arena.c: Bump allocator arenas
+
+*/
+
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+static __thread arena_t *thread_arena = NULL;
+
+
+int
+arena_init(arena_t *arena, size_t size) {
+    arena->base = malloc(size);
+    if (!arena->base)
+        return -1;
+    arena->size = size;
+    arena->used = 0;
+    return 0;
+}
+
+/* NULL when the arena is exhausted */
+void *
+arena_alloc(arena_t *arena, size_t n) {
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (start + n > arena->size)
+        return NULL;
+    arena->used = start + n;
+    return arena->base + start;
+}
+
+void
+arena_reset(arena_t *arena) {
+    arena->used = 0;
+}
+
+void
+arena_free(arena_t *arena) {
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = arena->used = 0;
+}
+
+void
+arena_thread_destroy(void *ptr) {
+    arena_free(ptr);
+    free(ptr);
+}
+
+void
+arena_key_create(void) {
+    pthread_key_create(&arena_key, arena_thread_destroy);
+}
+
+/* Calling thread's own arena, created on first use and freed when the
+   thread exits */
+arena_t *
+arena_thread(void) {
+    if (thread_arena)
+        return thread_arena;
+
+    pthread_once(&arena_key_once, arena_key_create);
+    arena_t *arena = malloc(sizeof(arena_t));
+    if (!arena)
+        return NULL;
+    if (arena_init(arena, ARENA_SIZE) < 0) {
+        free(arena);
+        return NULL;
+    }
+    pthread_setspecific(arena_key, arena);
+    thread_arena = arena;
+    return arena;
+}
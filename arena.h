@@ -0,0 +1,43 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_SIZE  (256 * 1024)
+
+/* Structs */
+/* Bump allocator, everything is released at once by arena_reset() */
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} arena_t;
+
+int arena_init(arena_t *arena, size_t size);
+void *arena_alloc(arena_t *arena, size_t n);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+arena_t *arena_thread(void);
+
+#endif
@@ -0,0 +1,356 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    autoindex.c: Directory listings
+
+*/
+
+#define _GNU_SOURCE /* qsort_r */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#include "strutils.h"
+#include "mime.h"
+
+#include "autoindex.h"
+
+/* Everything in a row but the name, twice, and the type */
+#define ROW_OVERHEAD    128
+
+#define AUTOINDEX_INTRO \
+"<!DOCTYPE html>\n" \
+"<html>\n" \
+"  <head>\n" \
+"    <base href=\"%s%s\">\n" \
+"    <style>\n" \
+"    table, th, td {\n" \
+"      border: 1px solid;\n" \
+"    }\n" \
+"    </style>\n" \
+"  </head>\n" \
+"  <body>\n" \
+"    <h1>Index Of %s</h1>\n" \
+"    <hr>\n" \
+"    <table>\n" \
+"      <tr>\n"
+
+#define AUTOINDEX_OUTRO \
+"  </body>\n" \
+"</html>\n"
+
+static const char *sort_names[] = { "name", "size", "date" };
+
+
+/* Escaped for both text and attribute values */
+void
+strbuf_html(strbuf_t *sb, const char *str) {
+    const char *start = str;
+    for (; *str; str++) {
+        const char *esc = NULL;
+        switch (*str) {
+            case '&': esc = "&amp;"; break;
+            case '<': esc = "&lt;"; break;
+            case '>': esc = "&gt;"; break;
+            case '"': esc = "&quot;"; break;
+            default: continue;
+        }
+        strbuf_append(sb, start, str - start);
+        strbuf_cat(sb, esc);
+        start = str + 1;
+    }
+    strbuf_append(sb, start, str - start);
+}
+
+/* Percent-encoded for a URL path, '/' kept as the separator. The result
+   needs no HTML escaping */
+void
+strbuf_url(strbuf_t *sb, const char *str) {
+    static const char hex[] = "0123456789ABCDEF";
+    const char *start = str;
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+            c == '~' || c == '/')
+            continue;
+        char esc[3] = { '%', hex[c >> 4], hex[c & 15] };
+        strbuf_append(sb, start, str - start);
+        strbuf_append(sb, esc, 3);
+        start = str + 1;
+    }
+    strbuf_append(sb, start, str - start);
+}
+
+int
+autoindex_cmp(const void *a, const void *b, void *arg) {
+    const autoindex_t *ai = arg;
+    const autoindex_entry_t *ea = &ai->entries[*(const size_t*)a];
+    const autoindex_entry_t *eb = &ai->entries[*(const size_t*)b];
+    switch (ai->sorting) {
+        case AUTOINDEX_SORT_SIZE:
+            if (ea->size != eb->size)
+                return ea->size < eb->size ? -1 : 1;
+            break;
+        case AUTOINDEX_SORT_DATE:
+            if (ea->mtime != eb->mtime)
+                return ea->mtime < eb->mtime ? -1 : 1;
+            break;
+        default:
+            break;
+    }
+    return strcmp(ea->name, eb->name);
+}
+
+void
+autoindex_view_free(autoindex_view_t *view) {
+    if (!view) return;
+    free(view->buff);
+    free(view->offsets);
+    free(view);
+}
+
+/* Rows of every entry in one buffer, in the order asked for */
+autoindex_view_t *
+autoindex_render(autoindex_t *ai, autoindex_sort_t sort, int desc) {
+    autoindex_view_t *view = calloc(1, sizeof(autoindex_view_t));
+    size_t *order = malloc((ai->count + 1) * sizeof(size_t));
+    if (view)
+        view->offsets = malloc((ai->count + 1) * sizeof(size_t));
+    if (!view || !order || !view->offsets) {
+        autoindex_view_free(view);
+        free(order);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < ai->count; i++)
+        order[i] = i;
+    ai->sorting = sort;
+    qsort_r(order, ai->count, sizeof(size_t), autoindex_cmp, ai);
+
+    /* The name twice, percent-encoded at 3 and HTML escaped at 6 chars per
+       char at most */
+    size_t size = 1;
+    for (size_t i = 0; i < ai->count; i++) {
+        size += ROW_OVERHEAD + 12 * ai->entries[i].namelen +
+            strlen(ai->entries[i].type);
+    }
+    view->buff = malloc(size);
+    if (!view->buff) {
+        autoindex_view_free(view);
+        free(order);
+        return NULL;
+    }
+
+    strbuf_t sb;
+    strbuf_init(&sb, view->buff, size);
+    char tempbuff[64];
+    for (size_t i = 0; i < ai->count; i++) {
+        const autoindex_entry_t *entry =
+            &ai->entries[order[desc ? ai->count - 1 - i : i]];
+        view->offsets[i] = sb.len;
+
+        strbuf_lit(&sb, "<tr>\n<td><a href=\"");
+        strbuf_url(&sb, entry->name);
+        if (entry->isdir)
+            strbuf_lit(&sb, "/");
+        strbuf_lit(&sb, "\">");
+        strbuf_html(&sb, entry->name);
+        strbuf_lit(&sb, "</a></td>\n<td>");
+        if (!entry->isdir)
+            strbuf_cat(&sb, human_size(entry->size, tempbuff, 64));
+        strbuf_lit(&sb, "</td>\n<td>");
+        strbuf_cat(&sb, entry->type);
+        strbuf_lit(&sb, "</td>\n<td>");
+        struct tm lt;
+        localtime_r(&entry->mtime, &lt);
+        strftime(tempbuff, 64, "%Y-%b-%d %H:%M", &lt);
+        strbuf_cat(&sb, tempbuff);
+        strbuf_lit(&sb, "</td>\n</tr>\n");
+    }
+    view->offsets[ai->count] = sb.len;
+
+    free(order);
+    return view;
+}
+
+/* Exports */
+
+/* Read the directory at path once, NULL and errno set on failure */
+autoindex_t *
+autoindex_scan(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir)
+        return NULL;
+
+    autoindex_t *ai = calloc(1, sizeof(autoindex_t));
+    if (!ai) {
+        closedir(dir);
+        return NULL;
+    }
+    pthread_mutex_init(&ai->lock, NULL);
+    ai->refs = 1;
+
+    size_t cap = 0;
+    struct dirent *direntry;
+    while ((direntry = readdir(dir)) != NULL) {
+        if (strcmp(direntry->d_name, ".") == 0) continue;
+
+        if (ai->count == cap) {
+            cap = cap ? 2 * cap : 64;
+            autoindex_entry_t *entries = realloc(ai->entries,
+                cap * sizeof(autoindex_entry_t));
+            if (!entries) goto error;
+            ai->entries = entries;
+        }
+
+        /* Relative to the open directory, nothing else to resolve */
+        struct stat statbuf;
+        if (fstatat(dirfd(dir), direntry->d_name, &statbuf, 0) < 0)
+            memset(&statbuf, 0, sizeof(statbuf));
+
+        autoindex_entry_t *entry = &ai->entries[ai->count];
+        entry->namelen = strlen(direntry->d_name);
+        entry->name = stralloccpy(direntry->d_name, entry->namelen);
+        if (!entry->name) goto error;
+        entry->isdir = S_ISDIR(statbuf.st_mode);
+        entry->size = statbuf.st_size;
+        entry->mtime = statbuf.st_mtime;
+        /* Extension only, libmagic on every entry is what made big
+           listings slow */
+        entry->type = entry->isdir ? "inode/directory" :
+            mime_by_ext(direntry->d_name);
+        if (!entry->type)
+            entry->type = MIME_DEFAULT;
+        ai->count++;
+    }
+
+    closedir(dir);
+    return ai;
+
+error:
+    closedir(dir);
+    autoindex_unref(ai);
+    return NULL;
+}
+
+void
+autoindex_ref(autoindex_t *ai) {
+    __atomic_add_fetch(&ai->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+autoindex_unref(autoindex_t *ai) {
+    if (__atomic_sub_fetch(&ai->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for (size_t i = 0; i < ai->count; i++)
+        free(ai->entries[i].name);
+    free(ai->entries);
+    for (int s = 0; s < AUTOINDEX_SORT_MAX; s++) {
+        autoindex_view_free(ai->views[s][0]);
+        autoindex_view_free(ai->views[s][1]);
+    }
+    pthread_mutex_destroy(&ai->lock);
+    free(ai);
+}
+
+/* Rendered rows [first, first + n) in the order asked for, one contiguous
+   span rendered on first use and kept with the listing. Returns its
+   length, -1 when out of memory */
+ssize_t
+autoindex_rows(autoindex_t *ai, autoindex_sort_t sort, int desc,
+    size_t first, size_t n, const char **rows)
+{
+    pthread_mutex_lock(&ai->lock);
+    autoindex_view_t *view = ai->views[sort][desc];
+    if (!view)
+        view = ai->views[sort][desc] = autoindex_render(ai, sort, desc);
+    pthread_mutex_unlock(&ai->lock);
+    if (!view)
+        return -1;
+
+    if (first > ai->count) first = ai->count;
+    if (n > ai->count - first) n = ai->count - first;
+    *rows = view->buff + view->offsets[first];
+    return view->offsets[first + n] - view->offsets[first];
+}
+
+/* Page head, column titles sort by themselves or flip the order */
+void
+autoindex_head(strbuf_t *sb, const char *endpoint, autoindex_sort_t sort,
+    int desc)
+{
+    char base[PATH_MAX_ESC], title[PATH_MAX_ESC];
+    strbuf_t esc;
+    strbuf_init(&esc, base, sizeof(base));
+    strbuf_url(&esc, endpoint);
+    strbuf_init(&esc, title, sizeof(title));
+    strbuf_html(&esc, endpoint);
+    int slash = endpoint[0] && endpoint[strlen(endpoint) - 1] == '/';
+
+    strbuf_printf(sb, AUTOINDEX_INTRO, base, slash ? "" : "/", title);
+    for (autoindex_sort_t s = 0; s < AUTOINDEX_SORT_MAX; s++) {
+        static const char *titles[] = { "Name", "Size", "Date" };
+        if (s == AUTOINDEX_SORT_DATE)
+            strbuf_lit(sb, "        <th>Type</th>\n");
+        strbuf_printf(sb, "        <th><a href=\"?sort=%s&amp;order=%s\">%s"
+            "</a></th>\n", sort_names[s],
+            s == sort && !desc ? "desc" : "asc", titles[s]);
+    }
+    strbuf_lit(sb, "      </tr>\n");
+}
+
+/* Page links and the end of the document */
+void
+autoindex_tail(strbuf_t *sb, autoindex_sort_t sort, int desc, size_t page,
+    size_t pages)
+{
+    strbuf_lit(sb, "    </table>\n");
+    if (pages > 1) {
+        strbuf_lit(sb, "    <p>\n");
+        if (page > 1)
+            strbuf_printf(sb, "      <a href=\"?sort=%s&amp;order=%s&amp;"
+                "page=%zu\">Previous</a>\n", sort_names[sort],
+                desc ? "desc" : "asc", page - 1);
+        strbuf_printf(sb, "      Page %zu of %zu\n", page, pages);
+        if (page < pages)
+            strbuf_printf(sb, "      <a href=\"?sort=%s&amp;order=%s&amp;"
+                "page=%zu\">Next</a>\n", sort_names[sort],
+                desc ? "desc" : "asc", page + 1);
+        strbuf_lit(sb, "    </p>\n");
+    }
+    strbuf_lit(sb, AUTOINDEX_OUTRO);
+}
+
+/* Sort key named in a query, name when unknown */
+autoindex_sort_t
+autoindex_sort(const char *name, size_t len) {
+    for (int s = 0; s < AUTOINDEX_SORT_MAX; s++) {
+        if (strlen(sort_names[s]) == len && strncmp(sort_names[s], name, len) == 0)
+            return s;
+    }
+    return AUTOINDEX_SORT_NAME;
+}
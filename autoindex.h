@@ -0,0 +1,79 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _AUTOINDEX_H
+#define _AUTOINDEX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "strutils.h"
+
+/* Room for an escaped endpoint */
+#define PATH_MAX_ESC    (6 * 1024)
+
+typedef enum {
+    AUTOINDEX_SORT_NAME,
+    AUTOINDEX_SORT_SIZE,
+    AUTOINDEX_SORT_DATE,
+    AUTOINDEX_SORT_MAX
+} autoindex_sort_t;
+
+typedef struct {
+    char *name;
+    size_t namelen;
+    int isdir;
+    off_t size;
+    time_t mtime;
+    const char *type;   /* static or interned */
+} autoindex_entry_t;
+
+/* Listing rendered in one order, row i starts at offsets[i] */
+typedef struct {
+    char *buff;
+    size_t *offsets;
+} autoindex_view_t;
+
+/* Directory read once, views are rendered as they are asked for. Shared
+   through the file cache, refcounted */
+typedef struct autoindex_s {
+    autoindex_entry_t *entries;
+    size_t count;
+    autoindex_view_t *views[AUTOINDEX_SORT_MAX][2];  /* [sort][desc] */
+    autoindex_sort_t sorting;   /* comparator argument, under lock */
+    pthread_mutex_t lock;
+    int refs;
+} autoindex_t;
+
+autoindex_t *autoindex_scan(const char *path);
+void autoindex_ref(autoindex_t *ai);
+void autoindex_unref(autoindex_t *ai);
+ssize_t autoindex_rows(autoindex_t *ai, autoindex_sort_t sort, int desc,
+    size_t first, size_t n, const char **rows);
+void autoindex_head(strbuf_t *sb, const char *endpoint, autoindex_sort_t sort,
+    int desc);
+void autoindex_tail(strbuf_t *sb, autoindex_sort_t sort, int desc, size_t page,
+    size_t pages);
+autoindex_sort_t autoindex_sort(const char *name, size_t len);
+
+#endif
@@ -23,7 +23,10 @@
 #include "cache.h"
 
 #include "hashmap.h"
+#include "config.h"
 #include "log.h"
+#include "mime.h"
+#include "slab.h"
 
 #include <sys/stat.h>
 #include <sys/inotify.h>
@@ -36,32 +39,156 @@
 #include <pthread.h>
 
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
 
-static char resolved_path[PATH_MAX];
-
 static hashtable_t file_cache;
 
+/* Content mappings, never handed back so a stale pointer still points at
+   a refcount */
+static slab_t *content_slab = NULL;
+
+/* Cached mappings in CLOCK order and what they add up to. Mappings are
+   published and unpublished under content_lock, taken before any stripe */
+static pthread_mutex_t content_lock = PTHREAD_MUTEX_INITIALIZER;
+static CACHED_CONTENT *clock_hand = NULL;
+static size_t content_bytes = 0;
+static int content_count = 0;
+static unsigned long content_misses = 0, content_evictions = 0;
+static unsigned long content_rejected = 0;
+static size_t content_evicted = 0;  /* bytes */
+
+/* Admission: count-min sketch of how often files were asked for, 4-bit
+   saturating counters halved every SKETCH_SAMPLES_PER_COUNTER times its
+   width accesses so old popularity fades */
+#define SKETCH_ROWS                 4
+#define SKETCH_COUNTER_MAX          15
+#define SKETCH_SAMPLES_PER_COUNTER  10
+#define SKETCH_VICTIM_SCAN          16  /* ring entries looked at */
+static uint8_t *sketch = NULL;
+static size_t sketch_mask = 0;      /* width - 1 */
+static unsigned long sketch_samples = 0;
+
 static int infd = 0;
 
+/* Open file cache, guarded by fd_cache_lock */
+static pthread_mutex_t fd_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static htdata_t *fd_lru_head = NULL, *fd_lru_tail = NULL;
+static int fd_cache_count = 0;
+
+/* Directory listings, guarded by listing_lock */
+static pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Watch descriptors to the entries on them, chained through wd_next. Hard
+   links share a watch, so one wd may have several entries. An entry is
+   indexed while its wd is >= 0. Guarded by wd_lock, nothing else is taken
+   under it */
+#define WD_BUCKETS  1024    /* to start with, doubled as entries come */
+static pthread_mutex_t wd_lock = PTHREAD_MUTEX_INITIALIZER;
+static hashtable_node_t **wd_buckets = NULL;
+static size_t wd_mask = 0;
+static size_t wd_count = 0;
+
+/* Entries coming and going also tell directories apart */
+#define WATCH_MASK  (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | \
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+/* The watch no longer follows the path */
+#define WATCH_GONE  (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)
+
+
+void
+wd_link(hashtable_node_t *node) {
+    hashtable_node_t **b = &wd_buckets[(size_t)node->data.wd & wd_mask];
+    node->data.wd_next = *b;
+    *b = node;
+    wd_count++;
+}
 
-hashtable_node_t *
-hashtable_find_wd(int wd) {
-    /* @lenny this uhh how are you supposed to fuckin iterate through your
-       hash table already */
-    hashtable_node_t *file_cache_current = NULL;
-    for (int i = 0; i < file_cache.size; i++) {
-        file_cache_current = file_cache.table + i;
-        if (!file_cache_current->key) continue;
-        while (file_cache_current) {
-            if (file_cache_current->data.wd == wd)
-                return file_cache_current;
-            file_cache_current = file_cache_current->next;
+void
+wd_unlink(hashtable_node_t *node) {
+    hashtable_node_t **p = &wd_buckets[(size_t)node->data.wd & wd_mask];
+    while (*p && *p != node)
+        p = &(*p)->data.wd_next;
+    if (*p) {
+        *p = node->data.wd_next;
+        wd_count--;
+    }
+    node->data.wd_next = NULL;
+}
+
+/* Twice the buckets, chains stay short. Called locked */
+void
+wd_grow() {
+    size_t size = (wd_mask + 1) * 2;
+    hashtable_node_t **buckets = calloc(size, sizeof(hashtable_node_t*));
+    if (!buckets)
+        return; /* longer chains, still right */
+    for (size_t i = 0; i <= wd_mask; i++) {
+        hashtable_node_t *node = wd_buckets[i];
+        while (node) {
+            hashtable_node_t *next = node->data.wd_next;
+            hashtable_node_t **b = &buckets[(size_t)node->data.wd & (size - 1)];
+            node->data.wd_next = *b;
+            *b = node;
+            node = next;
         }
     }
-    return NULL;
+    free(wd_buckets);
+    wd_buckets = buckets;
+    wd_mask = size - 1;
+}
+
+/* Move node to watch wd, or out of the index with -1 */
+void
+wd_index_set(hashtable_node_t *node, int wd) {
+    pthread_mutex_lock(&wd_lock);
+    if (node->data.wd >= 0)
+        wd_unlink(node);
+    __atomic_store_n(&node->data.wd, wd, __ATOMIC_RELEASE);
+    if (wd >= 0) {
+        wd_link(node);
+        if (wd_count > wd_mask + 1)
+            wd_grow();
+    }
+    pthread_mutex_unlock(&wd_lock);
+}
+
+/* Entries on watch wd into *found, grown as needed, to be worked on
+   unlocked. With unwatch they are taken off it too. Returns how many */
+size_t
+wd_collect(int wd, int unwatch, hashtable_node_t ***found, size_t *cap) {
+    size_t n = 0;
+    pthread_mutex_lock(&wd_lock);
+    hashtable_node_t **p = &wd_buckets[(size_t)wd & wd_mask];
+    while (*p) {
+        hashtable_node_t *node = *p;
+        if (node->data.wd != wd) {
+            p = &node->data.wd_next;
+            continue;
+        }
+        if (n == *cap) {
+            size_t size = *cap ? *cap * 2 : 16;
+            hashtable_node_t **grown = realloc(*found,
+                size * sizeof(hashtable_node_t*));
+            if (!grown)
+                break;
+            *found = grown;
+            *cap = size;
+        }
+        (*found)[n++] = node;
+        if (unwatch) {
+            *p = node->data.wd_next;
+            node->data.wd_next = NULL;
+            wd_count--;
+            __atomic_store_n(&node->data.wd, -1, __ATOMIC_RELEASE);
+        } else {
+            p = &node->data.wd_next;
+        }
+    }
+    pthread_mutex_unlock(&wd_lock);
+    return n;
 }
 
 
@@ -72,12 +199,343 @@ min(int a, int b) {
 
 void *inotify_poll_loop(void *ptr);
 
+void
+fd_lru_unlink(htdata_t *data) {
+    if (data->fd_prev) data->fd_prev->fd_next = data->fd_next;
+    else fd_lru_head = data->fd_next;
+    if (data->fd_next) data->fd_next->fd_prev = data->fd_prev;
+    else fd_lru_tail = data->fd_prev;
+    data->fd_prev = data->fd_next = NULL;
+}
+
+void
+fd_lru_append(htdata_t *data) {
+    data->fd_prev = fd_lru_tail;
+    data->fd_next = NULL;
+    if (fd_lru_tail) fd_lru_tail->fd_next = data;
+    else fd_lru_head = data;
+    fd_lru_tail = data;
+}
+
+void
+fd_unref(CACHED_FD *cfd) {
+    if (--cfd->refs == 0) {
+        close(cfd->fd);
+        free(cfd);
+    }
+}
+
+/* Forget the entry's descriptor, closed once the last user lets go. Called
+   locked */
+void
+fd_cache_drop(htdata_t *data) {
+    CACHED_FD *cfd = data->open_fd;
+    if (!cfd) return;
+    data->open_fd = NULL;
+    fd_lru_unlink(data);
+    fd_cache_count--;
+    fd_unref(cfd);
+}
+
+void *
+cache_report_loop(void *ptr) {
+    int interval = *(int*)ptr;
+    unsigned long reported = 0;
+    char msg[256];
+    while (1) {
+        sleep(interval);
+        pthread_mutex_lock(&content_lock);
+        int count = content_count;
+        size_t bytes = content_bytes, evicted = content_evicted;
+        unsigned long evictions = content_evictions;
+        unsigned long rejected = content_rejected;
+        pthread_mutex_unlock(&content_lock);
+        unsigned long misses =
+            __atomic_load_n(&content_misses, __ATOMIC_RELAXED);
+
+        /* Quiet while nothing is being mapped */
+        if (misses == reported) continue;
+        reported = misses;
+        snprintf(msg, 256, "content cache: %d files, %zu KiB mapped, "
+            "%lu misses, %lu rejected, %lu evictions, %zu KiB evicted",
+            count, bytes / 1024, misses, rejected, evictions,
+            evicted / 1024);
+        console_log(LOG_INFO, NULL, msg, NULL);
+    }
+}
+
+/* Copy of the entry's stat without taking a lock, retried while a writer
+   is at it. seq lets the caller tell later whether it changed since */
+int
+entry_stat(htdata_t *data, struct stat *buf, unsigned int *seq) {
+    unsigned int s;
+    int cached;
+    htstat_t st;
+    while (1) {
+        s = __atomic_load_n(&data->seq, __ATOMIC_ACQUIRE);
+        if (s & 1)
+            continue;
+        cached = IS_CACHED_STAT(data->flags);
+        st = data->stat_data;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&data->seq, __ATOMIC_RELAXED) == s)
+            break;
+    }
+    *seq = s;
+    if (cached) {
+        /* Only what requests look at is kept */
+        memset(buf, 0, sizeof(struct stat));
+        buf->st_ino = st.ino;
+        buf->st_size = st.size;
+        buf->st_mtim = st.mtim;
+        buf->st_mode = st.mode;
+    }
+    return cached;
+}
+
+/* Store or, buf NULL, forget the entry's stat. Called with the entry's
+   stripe locked */
+void
+entry_stat_set(htdata_t *data, const struct stat *buf) {
+    __atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (buf) {
+        data->stat_data.ino = buf->st_ino;
+        data->stat_data.size = buf->st_size;
+        data->stat_data.mtim = buf->st_mtim;
+        data->stat_data.mode = buf->st_mode;
+        SET_CACHED_STAT(data->flags);
+    } else {
+        CLEAR_CACHED_STAT(data->flags);
+    }
+    __atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Reference to the entry's mapping without taking a lock. The count only
+   goes up while it's not zero, and the entry must still hold the mapping
+   after, or it may be a recycled one */
+CACHED_CONTENT *
+entry_content(htdata_t *data) {
+    CACHED_CONTENT *content;
+    while ((content = __atomic_load_n(&data->content, __ATOMIC_ACQUIRE))) {
+        int refs = __atomic_load_n(&content->refs, __ATOMIC_RELAXED);
+        while (refs > 0 && !__atomic_compare_exchange_n(&content->refs,
+            &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+        if (refs == 0)
+            continue;
+        if (__atomic_load_n(&data->content, __ATOMIC_ACQUIRE) == content)
+            return content;
+        cached_content_release(content);
+    }
+    return NULL;
+}
+
+/* Row i's counter, by double hashing */
+uint8_t *
+sketch_counter(uint64_t h, int i) {
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    return sketch + i * (sketch_mask + 1) + ((h1 + i * h2) & sketch_mask);
+}
+
+unsigned int
+sketch_estimate(uint64_t h) {
+    unsigned int min = SKETCH_COUNTER_MAX;
+    for (int i = 0; i < SKETCH_ROWS; i++) {
+        unsigned int c = __atomic_load_n(sketch_counter(h, i),
+            __ATOMIC_RELAXED);
+        if (c < min) min = c;
+    }
+    return min;
+}
+
+/* Halve every counter */
+void
+sketch_age() {
+    size_t n = SKETCH_ROWS * (sketch_mask + 1);
+    for (size_t i = 0; i < n; i++)
+        __atomic_store_n(sketch + i,
+            __atomic_load_n(sketch + i, __ATOMIC_RELAXED) >> 1,
+            __ATOMIC_RELAXED);
+}
+
+/* Lock-free and lossy under races, an estimate either way. Saturated
+   counters, those of the hot files, are only read */
+void
+sketch_record(uint64_t h) {
+    for (int i = 0; i < SKETCH_ROWS; i++) {
+        uint8_t *c = sketch_counter(h, i);
+        uint8_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (v < SKETCH_COUNTER_MAX)
+            __atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+    }
+    size_t period = SKETCH_SAMPLES_PER_COUNTER * (sketch_mask + 1);
+    if (__atomic_add_fetch(&sketch_samples, 1, __ATOMIC_RELAXED) == period) {
+        sketch_age();
+        __atomic_store_n(&sketch_samples, period / 2, __ATOMIC_RELAXED);
+    }
+}
+
+/* Behind the hand, where it's looked at last. Called locked */
+void
+clock_link(CACHED_CONTENT *content) {
+    if (!clock_hand) {
+        content->prev = content->next = content;
+        clock_hand = content;
+    } else {
+        content->next = clock_hand;
+        content->prev = clock_hand->prev;
+        clock_hand->prev->next = content;
+        clock_hand->prev = content;
+    }
+    content_bytes += content->size;
+    content_count++;
+}
+
+/* Called locked */
+void
+clock_unlink(CACHED_CONTENT *content) {
+    if (content->next == content) {
+        clock_hand = NULL;
+    } else {
+        if (clock_hand == content)
+            clock_hand = content->next;
+        content->prev->next = content->next;
+        content->next->prev = content->prev;
+    }
+    content->prev = content->next = NULL;
+    content_bytes -= content->size;
+    content_count--;
+}
+
+int
+content_over_budget() {
+    return (content_cache_size > 0 && content_bytes > content_cache_size) ||
+        (content_cache_entries > 0 && content_count > content_cache_entries);
+}
+
+/* Sweep the hand until the budgets hold, giving mappings hit since it last
+   passed another round. The entries keep their stat. Evicted mappings are
+   returned chained through next, to be released unlocked. Called locked */
+CACHED_CONTENT *
+clock_evict() {
+    CACHED_CONTENT *evicted = NULL;
+    while (clock_hand && content_over_budget()) {
+        CACHED_CONTENT *content = clock_hand;
+        if (__atomic_load_n(&content->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&content->referenced, 0, __ATOMIC_RELAXED);
+            clock_hand = content->next;
+            continue;
+        }
+        hashtable_lock(&file_cache, content->owner);
+        __atomic_store_n(&content->owner->data.content, NULL,
+            __ATOMIC_RELEASE);
+        hashtable_unlock(&file_cache, content->owner);
+        clock_unlink(content);
+        content_evictions++;
+        content_evicted += content->size;
+        content->next = evicted;
+        evicted = content;
+    }
+    return evicted;
+}
+
+/* Whether size more bytes would push the cache over a budget. Called
+   locked */
+int
+content_would_evict(size_t size) {
+    return (content_cache_size > 0 &&
+        content_bytes + size > content_cache_size) ||
+        (content_cache_entries > 0 &&
+        content_count + 1 > content_cache_entries);
+}
+
+/* What the hand would evict next, without moving it. Called locked */
+CACHED_CONTENT *
+clock_victim() {
+    CACHED_CONTENT *content = clock_hand;
+    for (int i = 0; content && i < SKETCH_VICTIM_SCAN; i++) {
+        if (!__atomic_load_n(&content->referenced, __ATOMIC_RELAXED))
+            return content;
+        content = content->next;
+        if (content == clock_hand)
+            break;
+    }
+    return clock_hand;
+}
+
+void
+content_release_evicted(CACHED_CONTENT *evicted) {
+    while (evicted) {
+        CACHED_CONTENT *next = evicted->next;
+        cached_content_release(evicted);
+        evicted = next;
+    }
+}
+
+/* Entry for file, watched from the moment it's created */
+hashtable_node_t *
+cache_node(const char *file) {
+    hashtable_node_t *node = hashtable_find(&file_cache, file);
+    if (node)
+        return node;
+
+    htdata_t new_data = { 0 };
+    new_data.wd = -1;
+    /* Add inotify watch, the same one if another thread beats us to it */
+    int wd = inotify_add_watch(infd, file, WATCH_MASK);
+    if (wd < 0)
+        console_log(LOG_ERR, "\t", "Cannot watch ", file);
+    else console_log(LOG_DBG, "\t", "Watching ", file);
+    node = hashtable_insert(&file_cache, file, new_data);
+    /* Indexed once published */
+    if (node && wd >= 0 &&
+        __atomic_load_n(&node->data.wd, __ATOMIC_ACQUIRE) < 0)
+        wd_index_set(node, wd);
+    return node;
+}
+
+/* Watch the path again after the watch went away with the inode it was
+   on, before anything about the file is read to be cached. Nothing is
+   cached for entries left unwatched */
+int
+cache_rewatch(hashtable_node_t *node) {
+    if (__atomic_load_n(&node->data.wd, __ATOMIC_ACQUIRE) >= 0)
+        return 0;
+    int wd = inotify_add_watch(infd, node->key, WATCH_MASK);
+    if (wd < 0)
+        return -1;
+    wd_index_set(node, wd);
+    console_log(LOG_DBG, "\t", "Watching again ", node->key);
+    return 0;
+}
+
 /* Exports */
 
 int
 cache_init() {
     /* Allocate hash table */
-    hashtable_new(&file_cache, CACHE_SIZE);
+    if (hashtable_new(&file_cache, CACHE_SIZE) < 0) {
+        printf("Error allocating file cache\n");
+        return -1;
+    }
+    content_slab = slab_create("content", sizeof(CACHED_CONTENT), 64);
+    /* Wide enough for a few times the files cached */
+    size_t width = 1024;
+    while (width < 65536 && (content_cache_entries == 0 ||
+        width < 4 * (size_t)content_cache_entries))
+        width <<= 1;
+    sketch = calloc(SKETCH_ROWS, width);
+    if (!sketch) {
+        printf("Error allocating cache admission sketch\n");
+        return -1;
+    }
+    sketch_mask = width - 1;
+    wd_buckets = calloc(WD_BUCKETS, sizeof(hashtable_node_t*));
+    if (!wd_buckets) {
+        printf("Error allocating watch index\n");
+        return -1;
+    }
+    wd_mask = WD_BUCKETS - 1;
     /* Initialise inotify API */
     infd = inotify_init1(IN_NONBLOCK);
     if (infd == -1) {
@@ -87,109 +545,371 @@ cache_init() {
     pthread_t inpoll_thread;
     pthread_create(&inpoll_thread, NULL, inotify_poll_loop, NULL);
     pthread_detach(inpoll_thread);
+    return 0;
 }
 
+/* Log the content cache's occupancy and evictions every interval seconds,
+   to size content_cache_size and content_cache_entries by */
 int
-cached_stat(const char *file, struct stat *buf) {
+cache_report_start(int interval) {
+    static int report_interval;
+    report_interval = interval;
+
+    pthread_t report_thread;
+    if (pthread_create(&report_thread, NULL, cache_report_loop,
+        &report_interval) != 0)
+    {
+        printf("Error creating cache report thread: %s\n", strerror(errno));
+        return -1;
+    }
+    pthread_detach(report_thread);
+    return 0;
+}
+
+/* Stat file by its real path, which goes to resolved (PATH_MAX bytes) on
+   success. Every other lookup is keyed by that path, so one file has one
+   entry however it was asked for */
+int
+cached_stat(const char *file, struct stat *buf, char *resolved) {
+    char resolved_path[PATH_MAX];
     file = realpath(file, resolved_path); /* Accesses disk, find alternative */
     if (!file) {
         return -1;
     }
-    htdata_t *cache_entry = hashtable_get(&file_cache, file);
-    if (cache_entry && IS_CACHED_STAT(cache_entry->flags)) {
+    hashtable_node_t *node = hashtable_find(&file_cache, file);
+    unsigned int seq = 0;
+    if (node && entry_stat(&node->data, buf, &seq)) {
         /* Cache hit */
-        *buf = cache_entry->stat_data;
         console_log(LOG_DBG, "\t", "Cache stat hit for ", file);
+        strcpy(resolved, file);
         return 0;
-    } else {
-        /* Cache miss */
-        int r = stat(file, buf);
-        if (r == 0) {
-            if (cache_entry) {
-                /* Hash table hit */
-                if (!IS_CACHED_STAT(cache_entry->flags))
-                cache_entry->stat_data = *buf;
-                SET_CACHED_STAT(cache_entry->flags);
-            } else {
-                /* Insert hash table */
-                htdata_t new_data;
-                new_data.flags = 0;
-                new_data.content_buff = NULL;
-                new_data.content_size = 0;
-                new_data.stat_data = *buf;
-                SET_CACHED_STAT(new_data.flags);
-                /* Add inotify watch */
-                new_data.wd = inotify_add_watch(infd, file, IN_MODIFY);
-                if (new_data.wd < 0)
-                    console_log(LOG_ERR, "\t", "Cannot watch ", file);
-                else console_log(LOG_DBG, "\t", "Watching ", file);
-                hashtable_insert(&file_cache, file, new_data);
-            }
-            console_log(LOG_DBG, "\t", "Cached stat for ", file);
+    }
+
+    /* Cache miss */
+    if (node)
+        cache_rewatch(node);
+    int r = stat(file, buf);
+    if (r == 0) {
+        if (!node)
+            node = cache_node(file);
+        if (node) {
+            hashtable_lock(&file_cache, node);
+            /* Unless it changed meanwhile */
+            if (node->data.seq == seq && node->data.wd >= 0)
+                entry_stat_set(&node->data, buf);
+            hashtable_unlock(&file_cache, node);
         }
-        return r;
+        console_log(LOG_DBG, "\t", "Cached stat for ", file);
+        strcpy(resolved, file);
     }
+    return r;
 }
 
-const char *
-cached_open(const char *filename, size_t *size) {
+/* Count a request for filename's content of size bytes and tell whether
+   it is cached or worth caching: free room, or asked for more often than
+   what it would push out. Those turned away are best sent without a
+   mapping */
+int
+cached_admit(const char *filename, size_t size) {
+    size_t len = strlen(filename);
+    uint64_t h = hashtable_hash(filename, len);
+    sketch_record(h);
+
+    hashtable_node_t *node = hashtable_hfind(&file_cache, h, filename, len);
+    if (node && __atomic_load_n(&node->data.content, __ATOMIC_ACQUIRE))
+        return 1;
+    /* Bigger than the whole budget, never cached */
+    if (content_cache_size > 0 && size > content_cache_size)
+        return 0;
+
+    int admit = 1;
+    pthread_mutex_lock(&content_lock);
+    if (content_would_evict(size)) {
+        CACHED_CONTENT *victim = clock_victim();
+        admit = !victim ||
+            sketch_estimate(h) > sketch_estimate(victim->owner->hash);
+    }
+    if (!admit)
+        content_rejected++;
+    pthread_mutex_unlock(&content_lock);
+    return admit;
+}
+
+/* Mapping of filename's content, shared with the cache when it can be and
+   cache is set. Released with cached_content_release, NULL and errno set
+   on failure */
+CACHED_CONTENT *
+cached_open(const char *filename, int cache) {
     if (!filename) return NULL;
-    htdata_t *cache_entry = hashtable_get(&file_cache, filename);
-    if (cache_entry && IS_CACHED_CONTENT(cache_entry->flags)) {
+    hashtable_node_t *node = hashtable_find(&file_cache, filename);
+    CACHED_CONTENT *content = node ? entry_content(&node->data) : NULL;
+    if (content) {
         /* Cache hit */
+        if (!__atomic_load_n(&content->referenced, __ATOMIC_RELAXED))
+            __atomic_store_n(&content->referenced, 1, __ATOMIC_RELAXED);
         console_log(LOG_DBG, "\t", "Content cache hit ", filename);
-        *size = cache_entry->content_size;
-        return cache_entry->content_buff;
-    } else {
-        /* Cache miss - mmap file */
-        struct stat sb;
-        int fd = open(filename, O_RDONLY);
-        if (fd < 0)
+        return content;
+    }
+
+    /* Cache miss - mmap file */
+    if (node)
+        cache_rewatch(node);
+    unsigned int seq = node ?
+        __atomic_load_n(&node->data.seq, __ATOMIC_ACQUIRE) : 0;
+    struct stat sb;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &sb) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    content = slab_alloc(content_slab);
+    if (!content) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    content->refs = 1;
+    content->size = sb.st_size;
+    content->buff = NULL;
+    content->referenced = 0;
+    content->owner = NULL;
+    content->prev = content->next = NULL;
+    /* Nothing to map for empty files */
+    if (content->size > 0) {
+        content->buff = mmap(NULL, content->size, PROT_READ, MAP_PRIVATE,
+            fd, 0);
+        if (content->buff == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            slab_free(content);
+            errno = err;
             return NULL;
+        }
+    }
+    close(fd);
+    __atomic_add_fetch(&content_misses, 1, __ATOMIC_RELAXED);
+    console_log(LOG_DBG, "\t", "Content cache miss ", filename);
+
+    /* Bigger than the whole budget, never cached */
+    if (!cache || (content_cache_size > 0 &&
+        content->size > content_cache_size))
+        return content;
+
+    if (!node)
+        node = cache_node(filename);
+    if (node) {
+        CACHED_CONTENT *evicted = NULL;
+        pthread_mutex_lock(&content_lock);
+        hashtable_lock(&file_cache, node);
+        /* Stays ours alone if another thread got there first or the file
+           changed since we looked */
+        int publish = !node->data.content && node->data.seq == seq &&
+            node->data.wd >= 0;
+        if (publish) {
+            content->refs++;
+            content->owner = node;
+            __atomic_store_n(&node->data.content, content, __ATOMIC_RELEASE);
+        }
+        hashtable_unlock(&file_cache, node);
+        if (publish) {
+            clock_link(content);
+            evicted = clock_evict();
+        }
+        pthread_mutex_unlock(&content_lock);
+        content_release_evicted(evicted);
+    }
+    return content;
+}
+
+void
+cached_content_ref(CACHED_CONTENT *content) {
+    __atomic_add_fetch(&content->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Unmapped by whoever lets go last, the cache or a sender */
+void
+cached_content_release(CACHED_CONTENT *content) {
+    if (__atomic_sub_fetch(&content->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (content->buff)
+        munmap(content->buff, content->size);
+    slab_free(content);
+}
+
+/* Open filename read-only, or share the descriptor already open for it.
+   NULL and errno set on failure */
+CACHED_FD *
+cached_fd_open(const char *filename) {
+    pthread_mutex_lock(&fd_cache_lock);
+    htdata_t *cache_entry = hashtable_get(&file_cache, filename);
+    if (cache_entry && cache_entry->open_fd) {
+        /* Cache hit */
+        CACHED_FD *cfd = cache_entry->open_fd;
+        cfd->refs++;
+        fd_lru_unlink(cache_entry);
+        fd_lru_append(cache_entry);
+        pthread_mutex_unlock(&fd_cache_lock);
+        return cfd;
+    }
+    pthread_mutex_unlock(&fd_cache_lock);
+    hashtable_node_t *node = hashtable_find(&file_cache, filename);
+    if (node)
+        cache_rewatch(node);
+
+    /* Cache miss - open outside the lock */
+    CACHED_FD *cfd = malloc(sizeof(CACHED_FD));
+    if (!cfd) return NULL;
+    cfd->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (cfd->fd < 0 || fstat(cfd->fd, &cfd->st) < 0) {
+        int err = errno;
+        if (cfd->fd >= 0) close(cfd->fd);
+        free(cfd);
+        errno = err;
+        return NULL;
+    }
+    cfd->refs = 1;
+    if (open_file_cache <= 0)
+        return cfd;
+
+    pthread_mutex_lock(&fd_cache_lock);
+    cache_entry = hashtable_get(&file_cache, filename);
+    if (!cache_entry) {
+        node = cache_node(filename);
+        cache_entry = node ? &node->data : NULL;
+    }
 
-        if (cache_entry && IS_CACHED_STAT(cache_entry->flags))
-            sb = cache_entry->stat_data;
-        else
-            cached_stat(filename, &sb);
+    /* If another thread got there first this one stays private */
+    if (cache_entry && !cache_entry->open_fd && cache_entry->wd >= 0) {
+        while (fd_cache_count >= open_file_cache && fd_lru_head)
+            fd_cache_drop(fd_lru_head);
+        cache_entry->open_fd = cfd;
+        cfd->refs++;
+        fd_lru_append(cache_entry);
+        fd_cache_count++;
+        console_log(LOG_DBG, "\t", "Cached descriptor for ", filename);
+    }
+    pthread_mutex_unlock(&fd_cache_lock);
+    return cfd;
+}
 
-        /* cached_stat creates entry, get it */
-        cache_entry = hashtable_get(&file_cache, filename);
+/* One more user of a descriptor cached_fd_open returned */
+void
+cached_fd_ref(CACHED_FD *cfd) {
+    pthread_mutex_lock(&fd_cache_lock);
+    cfd->refs++;
+    pthread_mutex_unlock(&fd_cache_lock);
+}
 
-        size_t _size = sb.st_size;
+void
+cached_fd_close(CACHED_FD *cfd) {
+    pthread_mutex_lock(&fd_cache_lock);
+    fd_unref(cfd);
+    pthread_mutex_unlock(&fd_cache_lock);
+}
 
-        char *ptr = mmap(NULL, _size, PROT_READ,
-            MAP_PRIVATE, fd, 0);
+/* Type of a file cached_stat has seen, resolved on first use */
+const char *
+cached_mime_type(const char *filename) {
+    htdata_t *cache_entry = hashtable_get(&file_cache, filename);
+    const char *type = cache_entry ?
+        __atomic_load_n(&cache_entry->mime_type, __ATOMIC_RELAXED) : NULL;
+    if (type)
+        return type;
+
+    type = mime_type(filename);
+    if (cache_entry)
+        __atomic_store_n(&cache_entry->mime_type, type, __ATOMIC_RELAXED);
+    return type;
+}
 
-        close(fd);
+/* Listing of the directory at dirpath, as cached_stat resolved it, read
+   on first use and kept until something in it changes. Released with
+   autoindex_unref */
+autoindex_t *
+cached_autoindex(const char *dirpath) {
+    pthread_mutex_lock(&listing_lock);
+    htdata_t *cache_entry = hashtable_get(&file_cache, dirpath);
+    if (cache_entry && cache_entry->listing) {
+        /* Cache hit */
+        autoindex_t *ai = cache_entry->listing;
+        autoindex_ref(ai);
+        pthread_mutex_unlock(&listing_lock);
+        console_log(LOG_DBG, "\t", "Listing cache hit ", dirpath);
+        return ai;
+    }
+    pthread_mutex_unlock(&listing_lock);
+
+    /* Cache miss - read outside the lock */
+    autoindex_t *ai = autoindex_scan(dirpath);
+    if (!ai)
+        return NULL;
+
+    pthread_mutex_lock(&listing_lock);
+    cache_entry = hashtable_get(&file_cache, dirpath);
+    /* Without an entry nothing would tell it went stale */
+    if (cache_entry && cache_entry->wd >= 0 && !cache_entry->listing) {
+        autoindex_ref(ai);
+        cache_entry->listing = ai;
+        console_log(LOG_DBG, "\t", "Cached listing for ", dirpath);
+    }
+    pthread_mutex_unlock(&listing_lock);
+    return ai;
+}
 
-        /* it should by all means exist but just in case */
-        if (cache_entry) {
-            cache_entry->content_buff = ptr;
-            cache_entry->content_size = _size;
-            SET_CACHED_CONTENT(cache_entry->flags);
-        } else {
-            /* Insert hash table */
-            htdata_t new_cache_entry = { 0 };
-            new_cache_entry.content_buff = ptr;
-            new_cache_entry.content_size = _size;
-            /* Add inotify watch */
-            new_cache_entry.wd = inotify_add_watch(infd, filename, IN_MODIFY);
-            if (new_cache_entry.wd < 0)
-                console_log(LOG_ERR, "\t", "Cannot watch ", filename);
-            else console_log(LOG_DBG, "\t", "Watching ", filename);
-            hashtable_node_t *new_node = 
-                hashtable_insert(&file_cache, filename, new_cache_entry);
-            SET_CACHED_CONTENT(cache_entry->flags);
+/* Forget what was cached about entry's file */
+void
+cache_invalidate(hashtable_node_t *entry) {
+    pthread_mutex_lock(&fd_cache_lock);
+    fd_cache_drop(&entry->data);
+    pthread_mutex_unlock(&fd_cache_lock);
+
+    pthread_mutex_lock(&content_lock);
+    hashtable_lock(&file_cache, entry);
+    entry_stat_set(&entry->data, NULL);
+    CACHED_CONTENT *content = entry->data.content;
+    __atomic_store_n(&entry->data.content, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->data.mime_type, NULL, __ATOMIC_RELAXED);
+    hashtable_unlock(&file_cache, entry);
+    if (content)
+        clock_unlink(content);
+    pthread_mutex_unlock(&content_lock);
+    /* Unmapped once the last sender is done with it */
+    if (content)
+        cached_content_release(content);
+
+    pthread_mutex_lock(&listing_lock);
+    if (entry->data.listing) {
+        autoindex_unref(entry->data.listing);
+        entry->data.listing = NULL;
+    }
+    pthread_mutex_unlock(&listing_lock);
+
+    console_log(LOG_DBG, "\t", "Cache invalidated for ", entry->key);
+}
+
+/* Events were lost, any entry may be stale. Every one is unwatched and
+   emptied, the next use watches it afresh */
+void
+cache_drop_all() {
+    hashtable_node_t *entry = hashtable_first(&file_cache);
+    for (; entry; entry = entry->all) {
+        int wd = __atomic_load_n(&entry->data.wd, __ATOMIC_ACQUIRE);
+        if (wd >= 0) {
+            wd_index_set(entry, -1);
+            inotify_rm_watch(infd, wd);
         }
-        console_log(LOG_DBG, "\t", "Content cache miss ", filename);
-        *size = _size;
-        return cache_entry->content_buff;
+        cache_invalidate(entry);
     }
 }
 
 /* inotify invalidator */
 void *
 inotify_poll_loop(void *ptr) {
+    (void)ptr;
     int poll_num = 0;
     nfds_t nfds = 1;
     struct pollfd fds;
@@ -199,7 +919,9 @@ inotify_poll_loop(void *ptr) {
     char buf[4096]
         __attribute__ ((aligned(__alignof__(struct inotify_event))));
     const struct inotify_event *event;
-    size_t len;
+    ssize_t len;
+    hashtable_node_t **found = NULL;
+    size_t cap = 0;
 
     while (1) {
         poll_num = poll(&fds, nfds, -1);
@@ -223,21 +945,21 @@ inotify_poll_loop(void *ptr) {
                 ptr += sizeof(struct inotify_event) + event->len)
             {
                 event = (const struct inotify_event *) ptr;
-                /* Find corresponding cache entry */
-                hashtable_node_t *entry = hashtable_find_wd(event->wd);
-                if (entry) {
-                    /* Assuming IN_MODIFIED, clear cached flags */
-                    CLEAR_CACHED_STAT(entry->data.flags);
-                    CLEAR_CACHED_CONTENT(entry->data.flags);
-                    munmap(entry->data.content_buff, entry->data.content_size);
-                    entry->data.content_buff = NULL;
-                    entry->data.content_size = 0;
-
-                    char key[256];
-                    strncpy(key, entry->key, entry->key_len);
-                    key[entry->key_len] = '\0';
-                    console_log(LOG_DBG, "\t", "Cache invalidated for ", key);
+                if (event->mask & IN_Q_OVERFLOW) {
+                    console_log(LOG_WARN, "\t", "inotify queue overflow, "
+                        "dropping the file cache", NULL);
+                    cache_drop_all();
+                    continue;
                 }
+                /* Replaced or gone, refills watch the path again. Unwatched
+                   first so nothing is cached meanwhile */
+                int gone = event->mask & WATCH_GONE;
+                size_t n = wd_collect(event->wd, gone, &found, &cap);
+                if (n > 0 && gone && !(event->mask & IN_IGNORED))
+                    inotify_rm_watch(infd, event->wd);
+                /* Assuming IN_MODIFIED, forget what we knew */
+                for (size_t i = 0; i < n; i++)
+                    cache_invalidate(found[i]);
             }
         }
     }
@@ -24,7 +24,9 @@
 #include <stdio.h>
 #include <sys/stat.h>
 
-#define CACHE_SIZE  65536
+#include "autoindex.h"
+
+#define CACHE_SIZE  4096    /* initial slots, the table grows */
 
 /* Our own FILE type */
 typedef struct {
@@ -32,8 +34,36 @@ typedef struct {
     char *buff;
 } CACHED_FILE;
 
+/* Read-only descriptor shared through the open file cache */
+typedef struct cached_fd_s {
+    int fd;
+    struct stat st;     /* fstat at open */
+    int refs;           /* the cache's own plus one per user */
+} CACHED_FD;
+
+/* Mapping of a file's content, shared by the cache and everyone sending
+   from it, unmapped when the last reference goes */
+typedef struct cached_content_s {
+    int refs;
+    size_t size;
+    char *buff;
+    int referenced;                     /* CLOCK bit, set by hits */
+    struct hashtable_node_s *owner;     /* entry caching it */
+    struct cached_content_s *prev;      /* CLOCK ring, cached ones only */
+    struct cached_content_s *next;
+} CACHED_CONTENT;
+
 int cache_init();
-int cached_stat(const char *file, struct stat *buf);
-const char *cached_open(const char *filename, size_t *size);
+int cache_report_start(int interval);
+int cached_stat(const char *file, struct stat *buf, char *resolved);
+int cached_admit(const char *filename, size_t size);
+CACHED_CONTENT *cached_open(const char *filename, int cache);
+void cached_content_ref(CACHED_CONTENT *content);
+void cached_content_release(CACHED_CONTENT *content);
+CACHED_FD *cached_fd_open(const char *filename);
+void cached_fd_ref(CACHED_FD *cfd);
+void cached_fd_close(CACHED_FD *cfd);
+const char *cached_mime_type(const char *filename);
+autoindex_t *cached_autoindex(const char *dirpath);
 
 #endif
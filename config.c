@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
 #include "strutils.h"
@@ -36,18 +37,41 @@ const char *config_type_strs[] = {
     "autoindex"
 };
 
+const char *server_mode_strs[] = {
+    "thread",
+    "epoll",
+    "uring"
+};
+
 /* Config */
-string_node_t *listen_list = NULL, *tls_listen_list = NULL;
+listen_node_t *listen_list = NULL, *tls_listen_list = NULL;
 location_node_t *location_list = NULL, *location_current = NULL;
 
 const char *cert_file = NULL, *cert_key_file = NULL;
 
-
-string_node_t *
-string_list_push(string_node_t **head, const char *str, size_t len) {
+server_mode_t server_mode = SERVER_THREAD;
+int event_loops = 0; /* 0 = one per online core */
+int keepalive_timeout = 15;     /* seconds, 0 = no keep-alive */
+int keepalive_requests = 100;   /* per connection, 0 = unlimited */
+int worker_threads = 256;       /* 0 = thread per connection */
+int worker_queue = 1024;        /* connections waiting for a worker */
+int worker_queue_delay = 1000;  /* ms waited before shedding, 0 = no limit */
+int slab_report_interval = 60;  /* s between pool and cache reports, 0 = never */
+int sendfile_threshold = 65536; /* bytes, 0 = never sendfile */
+int open_file_cache = 1024;     /* descriptors kept open, 0 = none */
+size_t content_cache_size = 268435456; /* bytes mapped, 0 = unbounded */
+int content_cache_entries = 16384; /* files mapped, 0 = unbounded */
+int tls_session_lifetime = 7200; /* s, 0 = no resumption */
+int autoindex_page = 1000;      /* listing rows per page, 0 = all */
+
+
+listen_node_t *
+listen_list_push(listen_node_t **head, const char *str, size_t len,
+    int workers)
+{
     if (!head) return NULL;
-    string_node_t *end = NULL;
-    string_node_t *new = malloc(sizeof(string_node_t));
+    listen_node_t *end = NULL;
+    listen_node_t *new = malloc(sizeof(listen_node_t));
     if (*head) {
         end = *head;
         while (end->next) end = end->next;
@@ -58,6 +82,7 @@ string_list_push(string_node_t **head, const char *str, size_t len) {
     }
     new->next = NULL;
     new->str = stralloccpy(str, len);
+    new->workers = workers;
     return new;
 }
 
@@ -78,9 +103,53 @@ location_list_push(location_node_t **head, const char *loc, size_t len) {
     new->next = NULL;
     new->location = stralloccpy(loc, len);
     new->config = NULL;
+    new->headers = NULL;
+    new->headerslen = 0;
+    new->mimeheader = 0;
     return new;
 }
 
+/* Render the location's static headers into one block, sent as is with
+   every response. Date is generated by the server */
+int
+location_compile(location_node_t *location) {
+    size_t len = 0;
+    config_node_t *config_current = location->config;
+    while (config_current) {
+        if (config_current->type == CONFIG_HEADER &&
+            strcasecmp(config_current->param1, "Date") != 0)
+        {
+            len += strlen(config_current->param1) + 2 +
+                strlen(config_current->param2) + 2;
+        }
+        config_current = config_current->next;
+    }
+
+    char *headers = malloc(len + 1);
+    if (!headers) return -1;
+    char *ptr = headers;
+
+    config_current = location->config;
+    while (config_current) {
+        if (config_current->type == CONFIG_MIMEHEADER) {
+            location->mimeheader = 1;
+        } else if (config_current->type == CONFIG_HEADER) {
+            if (strcasecmp(config_current->param1, "Date") == 0) {
+                printf("Warning: Date header is generated, ignoring it in "
+                    "location %s\n", location->location);
+            } else {
+                ptr += sprintf(ptr, "%s: %s\r\n", config_current->param1,
+                    config_current->param2);
+            }
+        }
+        config_current = config_current->next;
+    }
+
+    location->headers = headers;
+    location->headerslen = ptr - headers;
+    return 0;
+}
+
 location_node_t *
 location_list_find(location_node_t *head, const char *loc) {
     if (!head) return NULL;
@@ -153,7 +222,7 @@ substrchk(const char *str, const char *substr) {
 int
 config_parse(const char *config) {
     size_t config_length = strlen(config);
-    string_node_t *listen_list_current = NULL, *listen_list_prev = NULL;
+    listen_node_t *listen_list_current = NULL, *listen_list_prev = NULL;
 
     int line = 0;
     const char *ptr = config, *key, *value, *value_end;
@@ -198,15 +267,29 @@ config_parse(const char *config) {
 
         /* Valid keys */
         /* Context-less */
-        if (substrchk(key, "listen ")) { /* address/port */
+        if (substrchk(key, "listen ")) { /* address/port [tls] [workers] */
             if (argc != 1 && argc != 2) {
                 printf("Error: Wrong amount of arguments, line %d\n", line);
                 goto next;
             }
-            if (argc == 2 && p2 && strncmp(p2, "tls", 3) == 0) {
-                string_list_push(&tls_listen_list, p1, p1len);
+            int tls = 0, workers = 0;
+            if (argc == 2) {
+                char *tok = strtok(p2, " \t");
+                while (tok) {
+                    if (strcmp(tok, "tls") == 0)
+                        tls = 1;
+                    else if (isdigit(*tok))
+                        workers = atoi(tok);
+                    else
+                        printf("Error: Unknown listen option %s, line %d\n",
+                            tok, line);
+                    tok = strtok(NULL, " \t");
+                }
+            }
+            if (tls) {
+                listen_list_push(&tls_listen_list, p1, p1len, workers);
             } else {
-                string_list_push(&listen_list, p1, p1len);
+                listen_list_push(&listen_list, p1, p1len, workers);
             }
         }
         else if (substrchk(key, "certificate ")) { /* address/port */
@@ -231,6 +314,169 @@ config_parse(const char *config) {
             }
             cert_key_file = stralloccpy(p1, p1len);
         }
+        else if (substrchk(key, "server_mode ")) { /* thread, epoll, uring */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            if (strcmp(p1, "thread") == 0)
+                server_mode = SERVER_THREAD;
+            else if (strcmp(p1, "epoll") == 0)
+                server_mode = SERVER_EPOLL;
+            else if (strcmp(p1, "uring") == 0)
+                server_mode = SERVER_URING;
+            else
+                printf("Error: Unknown server mode %s, line %d\n", p1, line);
+        }
+        else if (substrchk(key, "event_loops ")) { /* Number of loops */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            event_loops = atoi(p1);
+            if (event_loops < 0) {
+                printf("Error: Invalid event loop count, line %d\n", line);
+                event_loops = 0;
+            }
+        }
+        else if (substrchk(key, "keepalive_timeout ")) { /* Idle seconds */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            keepalive_timeout = atoi(p1);
+            if (keepalive_timeout < 0) {
+                printf("Error: Invalid keep-alive timeout, line %d\n", line);
+                keepalive_timeout = 0;
+            }
+        }
+        else if (substrchk(key, "keepalive_requests ")) { /* Request cap */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            keepalive_requests = atoi(p1);
+            if (keepalive_requests < 0) {
+                printf("Error: Invalid keep-alive requests, line %d\n", line);
+                keepalive_requests = 0;
+            }
+        }
+        else if (substrchk(key, "worker_threads ")) { /* Pool size */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            worker_threads = atoi(p1);
+            if (worker_threads < 0) {
+                printf("Error: Invalid worker thread count, line %d\n", line);
+                worker_threads = 0;
+            }
+        }
+        else if (substrchk(key, "worker_queue ")) { /* Pool queue depth */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            worker_queue = atoi(p1);
+            if (worker_queue <= 0) {
+                printf("Error: Invalid worker queue depth, line %d\n", line);
+                worker_queue = 1024;
+            }
+        }
+        else if (substrchk(key, "worker_queue_delay ")) { /* ms */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            worker_queue_delay = atoi(p1);
+            if (worker_queue_delay < 0) {
+                printf("Error: Invalid worker queue delay, line %d\n", line);
+                worker_queue_delay = 0;
+            }
+        }
+        else if (substrchk(key, "slab_report_interval ")) { /* s */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            slab_report_interval = atoi(p1);
+            if (slab_report_interval < 0) {
+                printf("Error: Invalid report interval, line %d\n", line);
+                slab_report_interval = 0;
+            }
+        }
+        else if (substrchk(key, "sendfile_threshold ")) { /* bytes */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            sendfile_threshold = atoi(p1);
+            if (sendfile_threshold < 0) {
+                printf("Error: Invalid sendfile threshold, line %d\n", line);
+                sendfile_threshold = 0;
+            }
+        }
+        else if (substrchk(key, "open_file_cache ")) { /* descriptors */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            open_file_cache = atoi(p1);
+            if (open_file_cache < 0) {
+                printf("Error: Invalid open file cache size, line %d\n", line);
+                open_file_cache = 0;
+            }
+        }
+        else if (substrchk(key, "content_cache_size ")) { /* bytes */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            long long size = atoll(p1);
+            if (size < 0) {
+                printf("Error: Invalid content cache size, line %d\n", line);
+                size = 0;
+            }
+            content_cache_size = size;
+        }
+        else if (substrchk(key, "content_cache_entries ")) { /* files */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            content_cache_entries = atoi(p1);
+            if (content_cache_entries < 0) {
+                printf("Error: Invalid content cache entries, line %d\n",
+                    line);
+                content_cache_entries = 0;
+            }
+        }
+        else if (substrchk(key, "tls_session_lifetime ")) { /* s */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            tls_session_lifetime = atoi(p1);
+            if (tls_session_lifetime < 0) {
+                printf("Error: Invalid session lifetime, line %d\n", line);
+                tls_session_lifetime = 0;
+            }
+        }
+        else if (substrchk(key, "tls_ticket_rotate ")) { /* gone */
+            printf("Warning: tls_ticket_rotate is gone, libtls rotates "
+                "ticket keys itself, line %d\n", line);
+        }
+        else if (substrchk(key, "autoindex_page ")) { /* rows */
+            if (argc != 1) {
+                printf("Error: Wrong amount of arguments, line %d\n", line);
+                goto next;
+            }
+            autoindex_page = atoi(p1);
+            if (autoindex_page < 0) {
+                printf("Error: Invalid autoindex page size, line %d\n", line);
+                autoindex_page = 0;
+            }
+        }
         else if (substrchk(key, "location ")) {
             if (argc != 1) {
                 printf("Error: Wrong amount of arguments, line %d\n", line);
@@ -300,6 +546,10 @@ config_parse(const char *config) {
         if (!haspoint) printf("Error: No point in location %s\n",
             location_current->location);
 
+        if (location_compile(location_current) < 0)
+            printf("Error: Out of memory compiling location %s\n",
+                location_current->location);
+
         location_current = location_current->next;
     }
 
@@ -18,6 +18,7 @@
 
 */
 
+#include <stddef.h>
 #include <pthread.h>
 
 #ifndef _CONFIG_H
@@ -25,13 +26,15 @@
 
 /* Macros */
 #define BUFF_SIZE  65535
+#define STALL_TIMEOUT 30 /* s without progress, when keep-alive is off */
 
 /* Types */
-typedef struct string_node_s {
+typedef struct listen_node_s {
     const char *str;
-    struct string_node_s *prev;
-    struct string_node_s *next;
-} string_node_t;
+    int workers;        /* SO_REUSEPORT listeners, 0 = one shared listener */
+    struct listen_node_s *prev;
+    struct listen_node_s *next;
+} listen_node_t;
 
 typedef struct fd_thread_node_s {
     int fd;
@@ -41,6 +44,15 @@ typedef struct fd_thread_node_s {
 } fd_thread_node_t;
 
 
+/* Server modes */
+typedef enum {
+    SERVER_THREAD,    /* Thread per connection */
+    SERVER_EPOLL,     /* Edge-triggered epoll event loops */
+    SERVER_URING      /* io_uring completion loops */
+} server_mode_t;
+
+extern const char *server_mode_strs[];
+
 /* Webserver config types */
 typedef enum {
     CONFIG_ROOT,      /* Real path root */
@@ -63,14 +75,28 @@ typedef struct config_node_s {
 typedef struct location_node_s {
     const char *location;
     config_node_t *config;
+    char *headers;      /* configured headers, CRLF terminated, at load */
+    size_t headerslen;
+    int mimeheader;
     struct location_node_s *prev;
     struct location_node_s *next;
 } location_node_t;
 
 /* Config */
-extern string_node_t *listen_list, *tls_listen_list;
+extern listen_node_t *listen_list, *tls_listen_list;
 extern location_node_t *location_list;
 extern const char *cert_file, *cert_key_file;
+extern server_mode_t server_mode;
+extern int event_loops;
+extern int keepalive_timeout, keepalive_requests;
+extern int worker_threads, worker_queue, worker_queue_delay;
+extern int slab_report_interval;
+extern int sendfile_threshold;
+extern int open_file_cache;
+extern size_t content_cache_size;
+extern int content_cache_entries;
+extern int tls_session_lifetime;
+extern int autoindex_page;
 
 int config_parse(const char *config);
 
@@ -0,0 +1,468 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    event.c: epoll event loop server
+
+*/
+
+#define _GNU_SOURCE /* accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#include <pthread.h>
+
+#include <tls.h>
+
+#include "config.h"
+#include "log.h"
+#include "http.h"
+#include "socket_util.h"
+#include "slab.h"
+#include "tls_socket.h"
+#include "mime.h"
+
+#include "event.h"
+
+#define EVENT_MAX   256
+
+/* What an epoll_event data pointer refers to */
+typedef enum {
+    EVENT_LISTENER,
+    EVENT_CLIENT
+} event_type_t;
+
+typedef struct {
+    event_type_t type;
+    int fd;
+    struct tls *ctx;            /* server context of TLS listeners */
+} event_listener_t;
+
+typedef struct event_conn_s {
+    event_type_t type;
+    client_t cs;
+    char addrstr[128];
+    time_t last_active;
+    uint32_t events;            /* currently armed */
+    int handshake;              /* TLS handshake in progress */
+    int closing;                /* once the pending output is out */
+    struct event_conn_s *prev;  /* idle list, least recently active first */
+    struct event_conn_s *next;
+    size_t recvlen;
+    char recvbuff[BUFF_SIZE];
+} event_conn_t;
+
+typedef struct {
+    int epfd;
+    event_conn_t *idle_head;
+    event_conn_t *idle_tail;
+    slab_t *conns;
+} event_loop_t;
+
+/* Vars */
+fd_thread_node_t *event_loop_list = NULL;
+
+
+void
+event_idle_remove(event_loop_t *loop, event_conn_t *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->idle_head = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    else loop->idle_tail = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+/* Move to the back of the idle list */
+void
+event_idle_touch(event_loop_t *loop, event_conn_t *conn) {
+    conn->last_active = time(NULL);
+    if (loop->idle_tail == conn)
+        return;
+    if (conn->prev || conn->next || loop->idle_head == conn)
+        event_idle_remove(loop, conn);
+    conn->prev = loop->idle_tail;
+    if (loop->idle_tail) loop->idle_tail->next = conn;
+    else loop->idle_head = conn;
+    loop->idle_tail = conn;
+}
+
+/* Wait for ev (EPOLLIN or EPOLLOUT) next */
+void
+event_arm(event_loop_t *loop, event_conn_t *conn, uint32_t ev) {
+    if (conn->events == ev)
+        return;
+    struct epoll_event e;
+    e.events = ev | EPOLLRDHUP | EPOLLET;
+    e.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->cs.fd, &e) < 0) {
+        console_log(LOG_ERR, conn->addrstr, "Error modifying epoll: ",
+            strerror(errno));
+        return;
+    }
+    conn->events = ev;
+}
+
+void
+event_conn_close(event_loop_t *loop, event_conn_t *conn) {
+    event_idle_remove(loop, conn);
+    cs_close(&conn->cs);
+    slab_free(conn);
+}
+
+/* Close connections idle for longer than keepalive_timeout, or stuck
+   on output that long */
+void
+event_expire(event_loop_t *loop) {
+    int timeout = keepalive_timeout > 0 ? keepalive_timeout : STALL_TIMEOUT;
+    time_t now = time(NULL);
+    while (loop->idle_head &&
+        now - loop->idle_head->last_active >= timeout)
+    {
+        console_log(LOG_DBG, loop->idle_head->addrstr, "Keep-alive timeout",
+            NULL);
+        event_conn_close(loop, loop->idle_head);
+    }
+}
+
+void
+event_accept(event_loop_t *loop, event_listener_t *listener) {
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    char lfdstr[16];
+
+    /* Edge-triggered, drain the backlog */
+    while (1) {
+        salen = sizeof(struct sockaddr_storage);
+        int cfd = accept4(listener->fd, (struct sockaddr*)&sa, &salen,
+            SOCK_NONBLOCK);
+        if (cfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            snprintf(lfdstr, 16, "%d", listener->fd);
+            console_log(LOG_ERR, lfdstr, "Accepting client: ",
+                strerror(errno));
+            return;
+        }
+
+        event_conn_t *conn = slab_alloc(loop->conns);
+        if (!conn) {
+            close(cfd);
+            continue;
+        }
+        sa_addr_str((struct sockaddr*)&sa, conn->addrstr, 128);
+
+        /* No I/O yet, the handshake is driven by readiness events */
+        struct tls *cctx = NULL;
+        if (listener->ctx && tls_accept_socket(listener->ctx, &cctx, cfd) != 0)
+        {
+            console_log(LOG_ERR, conn->addrstr, "Accepting TLS client: ",
+                tls_error(listener->ctx));
+            close(cfd);
+            slab_free(conn);
+            continue;
+        }
+
+        conn->type = EVENT_CLIENT;
+        conn->recvlen = 0;
+        conn->events = EPOLLIN;
+        conn->handshake = cctx != NULL;
+        conn->closing = 0;
+        conn->prev = conn->next = NULL;
+        cs_init(&conn->cs, cfd, cctx, conn->addrstr);
+        conn->cs.nonblock = 1;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+            console_log(LOG_ERR, conn->addrstr, "Error adding to epoll: ",
+                strerror(errno));
+            cs_close(&conn->cs);
+            slab_free(conn);
+            continue;
+        }
+        /* Handshakes must finish within keepalive_timeout too */
+        event_idle_touch(loop, conn);
+
+        console_log(LOG_DBG, conn->addrstr, "Accepted client", NULL);
+    }
+}
+
+/* read, or tls_read for TLS connections. TLS_WANT_POLLIN or
+   TLS_WANT_POLLOUT when the socket has to be ready first */
+ssize_t
+event_recv(event_conn_t *conn, char *buf, size_t len) {
+    client_t *cs = &conn->cs;
+    if (cs->ctx) {
+        ssize_t r = tls_read(cs->ctx, buf, len);
+        if (r == -1)
+            console_log(LOG_ERR, conn->addrstr, "Error reading TLS client: ",
+                tls_error(cs->ctx));
+        return r;
+    }
+
+    while (1) {
+        ssize_t r = read(cs->fd, buf, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TLS_WANT_POLLIN;
+        if (r < 0)
+            console_log(LOG_ERR, conn->addrstr, "Error reading client: ",
+                strerror(errno));
+        return r;
+    }
+}
+
+/* Advance the TLS handshake, 1 when done, 0 when waiting, -1 on error */
+int
+event_handshake(event_loop_t *loop, event_conn_t *conn) {
+    client_t *cs = &conn->cs;
+    int r = tls_handshake(cs->ctx);
+    if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT) {
+        event_arm(loop, conn, r == TLS_WANT_POLLIN ? EPOLLIN : EPOLLOUT);
+        return 0;
+    } else if (r < 0) {
+        console_log(LOG_DBG, conn->addrstr, "TLS handshake: ",
+            tls_error(cs->ctx));
+        return -1;
+    }
+
+    conn->handshake = 0;
+    tls_session_count(cs->ctx);
+    console_log(LOG_DBG, conn->addrstr, "Accepted TLS client",
+        tls_conn_cipher(cs->ctx));
+    return 1;
+}
+
+/* Answer the requests received so far. 1 when output is left pending and
+   the socket has been armed for it, 0 to go on reading, -1 to close */
+int
+event_process(event_loop_t *loop, event_conn_t *conn) {
+    client_t *cs = &conn->cs;
+    while (1) {
+        ssize_t used = http_process_buffer(cs, conn->recvbuff,
+            conn->recvlen);
+        if (used < 0) {
+            /* After the last response */
+            conn->closing = 1;
+            used = conn->recvlen;
+        }
+        /* Keep the start of the next request */
+        memmove(conn->recvbuff, conn->recvbuff + used, conn->recvlen - used);
+        conn->recvlen -= used;
+        conn->recvbuff[conn->recvlen] = '\0';
+
+        if (!cs->pending)
+            return conn->closing ? -1 : 0;
+        int r = cs_drain(cs);
+        if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT) {
+            event_arm(loop, conn, r == TLS_WANT_POLLIN ? EPOLLIN : EPOLLOUT);
+            return 1;
+        } else if (r < 0 || conn->closing) {
+            return -1;
+        }
+        /* Drained after all, go on with what is buffered */
+    }
+}
+
+void
+event_read(event_loop_t *loop, event_conn_t *conn) {
+    client_t *cs = &conn->cs;
+    if (conn->handshake) {
+        int r = event_handshake(loop, conn);
+        if (r < 0)
+            goto doclose;
+        if (r == 0)
+            return;
+        /* The first request may already be buffered */
+    }
+
+    /* Output backed up last time goes first, reading waits for it */
+    if (cs->pending) {
+        int r = cs_drain(cs);
+        if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT) {
+            event_arm(loop, conn, r == TLS_WANT_POLLIN ? EPOLLIN : EPOLLOUT);
+            event_idle_touch(loop, conn);
+            return;
+        } else if (r < 0 || conn->closing) {
+            goto doclose;
+        }
+        event_arm(loop, conn, EPOLLIN);
+        /* Requests that came in meanwhile */
+        r = event_process(loop, conn);
+        if (r < 0)
+            goto doclose;
+        if (r > 0) {
+            event_idle_touch(loop, conn);
+            return;
+        }
+    }
+
+    /* Edge-triggered, read until the socket is drained */
+    while (1) {
+        ssize_t recvlen = event_recv(conn, conn->recvbuff + conn->recvlen,
+            BUFF_SIZE - 1 - conn->recvlen);
+        if (recvlen == TLS_WANT_POLLIN || recvlen == TLS_WANT_POLLOUT) {
+            event_arm(loop, conn,
+                recvlen == TLS_WANT_POLLIN ? EPOLLIN : EPOLLOUT);
+            break;
+        } else if (recvlen < 0) {
+            goto doclose;
+        } else if (recvlen == 0) {
+            console_log(LOG_DBG, conn->addrstr, "Client disconnected", NULL);
+            goto doclose;
+        }
+
+        conn->recvlen += recvlen;
+        conn->recvbuff[conn->recvlen] = '\0';
+        int r = event_process(loop, conn);
+        if (r < 0)
+            goto doclose;
+        if (r > 0)
+            break;
+    }
+
+    event_idle_touch(loop, conn);
+    return;
+
+doclose:
+    event_conn_close(loop, conn);
+}
+
+void *
+event_loop(void *ptr) {
+    event_loop_t *loop = (event_loop_t*)ptr;
+    struct epoll_event events[EVENT_MAX];
+    mime_thread_init();
+
+    while (1) {
+        /* Wake up every second to expire idle connections */
+        int n = epoll_wait(loop->epfd, events, EVENT_MAX, 1000);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            console_log(LOG_ERR, "\t", "Error waiting on epoll: ",
+                strerror(errno));
+            return NULL;
+        }
+
+        for (int i = 0; i < n; i++) {
+            event_type_t type = *(event_type_t*)events[i].data.ptr;
+            if (type == EVENT_LISTENER)
+                event_accept(loop, events[i].data.ptr);
+            else
+                event_read(loop, events[i].data.ptr);
+        }
+
+        event_expire(loop);
+    }
+}
+
+/* Exports */
+
+int
+event_loops_start(int n) {
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = 1;
+
+    for (int i = 0; i < n; i++) {
+        event_loop_t *loop = calloc(1, sizeof(event_loop_t));
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) {
+            printf("Error creating epoll instance: %s\n", strerror(errno));
+            return -1;
+        }
+        char slabname[32];
+        snprintf(slabname, 32, "epoll loop %d conn", i);
+        loop->conns = slab_create(slabname, sizeof(event_conn_t), 16);
+        if (!loop->conns) return -1;
+
+        /* push element */
+        fd_thread_node_t *node = fd_thread_list_push(&event_loop_list,
+            loop->epfd, 0);
+
+        /* run event loop thread */
+        pthread_t loop_thread;
+        pthread_create(&loop_thread, NULL, event_loop, loop);
+
+        node->thread = loop_thread;
+        thread_pin_cpu(loop_thread, i);
+    }
+
+    printf("started %d event loops\n", n);
+
+    return n;
+}
+
+/* shard < 0 shares the listener among all loops, otherwise it is owned by
+   loop (shard % loops) alone. ctx is the server context of TLS listeners,
+   NULL for plain ones */
+int
+event_add_listener(int lfd, int shard, struct tls *ctx) {
+    if (fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) < 0) {
+        printf("Error setting listen socket non-blocking: %s\n",
+            strerror(errno));
+        return -1;
+    }
+
+    event_listener_t *listener = malloc(sizeof(event_listener_t));
+    listener->type = EVENT_LISTENER;
+    listener->fd = lfd;
+    listener->ctx = ctx;
+
+    int nloops = 0;
+    fd_thread_node_t *loop_current = event_loop_list;
+    while (loop_current) {
+        nloops++;
+        loop_current = loop_current->next;
+    }
+    if (nloops == 0) return -1;
+
+    /* Shared: every loop waits on the listener, EPOLLEXCLUSIVE wakes only
+       one */
+    int i = 0;
+    loop_current = event_loop_list;
+    while (loop_current) {
+        if (shard < 0 || i == shard % nloops) {
+            struct epoll_event ev;
+            ev.events = shard < 0 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+            ev.data.ptr = listener;
+            if (epoll_ctl(loop_current->fd, EPOLL_CTL_ADD, lfd, &ev) < 0) {
+                printf("Error adding listener to epoll: %s\n",
+                    strerror(errno));
+                return -1;
+            }
+        }
+        loop_current = loop_current->next;
+        i++;
+    }
+
+    return lfd;
+}
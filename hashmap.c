@@ -27,80 +27,264 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define HASHTABLE_MIGRATE   8       /* slots copied per insert while growing */
+#define HASHTABLE_CHUNK     65536   /* bytes of nodes allocated at a time */
+#define HASHTABLE_ALIGN     16
+
+
+/* wyhash, final version 4 */
+static const uint64_t wyp[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline void
+wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+wymix(uint64_t a, uint64_t b) {
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t
+wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t
+wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t
+wyr3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
 static uint64_t
-hashn(const char *str, int len) {
-    uint64_t out = 7;
-    for (int i = 0; i < len; i++) {
-        out = (out * 31) + str[i];
+wyhash(const void *key, size_t len, uint64_t seed) {
+    const uint8_t *p = key;
+    uint64_t a, b;
+    seed ^= wymix(seed ^ wyp[0], wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) |
+                wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
     }
-    return out;
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
 }
 
-static uint64_t
-hash(const char *str) {
-    return hashn(str, strlen(str));
+static hashtable_index_t *
+index_new(size_t slots) {
+    hashtable_index_t *idx = calloc(1, sizeof(hashtable_index_t) +
+        slots * sizeof(hashtable_slot_t));
+    if (!idx) return NULL;
+    idx->mask = slots - 1;
+    return idx;
 }
 
-void
-hashtable_new(hashtable_t *ht, int size) {
-    ht->table = calloc(size, sizeof(hashtable_node_t));
-    ht->size = size;
+/* Lock-free, a slot's node is in place before its hash */
+static hashtable_node_t *
+index_find(const hashtable_index_t *idx, uint64_t hash, const char *key,
+    size_t len)
+{
+    for (size_t i = hash & idx->mask;; i = (i + 1) & idx->mask) {
+        uint64_t h = __atomic_load_n(&idx->slots[i].hash, __ATOMIC_ACQUIRE);
+        if (h == 0)
+            return NULL;
+        /* Stored hashes turn down nearly every other key without a
+           compare */
+        if (h != hash)
+            continue;
+        hashtable_node_t *n = idx->slots[i].node;
+        if (n->key_len == len && memcmp(n->key, key, len) == 0)
+            return n;
+    }
 }
 
-hashtable_node_t *
-hashtable_rnfind(hashtable_t *ht, const char *key, int key_len) {
-    hashtable_node_t *n = ht->table+(hashn(key, key_len) % ht->size);
-    
-lbl:
-    if (n == NULL) return NULL;
-    if (n->key_len == 0) return NULL;
-    if (n->key_len != key_len) {
-        n = n->next;
-        goto lbl;
+/* Called with the insert lock held */
+static void
+index_put(hashtable_index_t *idx, hashtable_node_t *n) {
+    size_t i = n->hash & idx->mask;
+    while (idx->slots[i].hash)
+        i = (i + 1) & idx->mask;
+    idx->slots[i].node = n;
+    __atomic_store_n(&idx->slots[i].hash, n->hash, __ATOMIC_RELEASE);
+    idx->used++;
+}
+
+/* Copy a few more slots into the bigger index, switching over once all
+   are. The old one stays readable by lookups that started on it */
+static void
+migrate(hashtable_t *ht, size_t count) {
+    hashtable_index_t *idx = ht->index, *next = ht->next;
+    size_t slots = idx->mask + 1;
+    for (; count > 0 && ht->migrated < slots; count--, ht->migrated++) {
+        hashtable_slot_t *slot = idx->slots + ht->migrated;
+        if (slot->hash)
+            index_put(next, slot->node);
     }
-    if (memcmp(n->key, key, key_len) != 0) {
-        n = n->next;
-        goto lbl;
+    if (ht->migrated < slots)
+        return;
+    next->retired = idx;
+    __atomic_store_n(&ht->index, next, __ATOMIC_RELEASE);
+    __atomic_store_n(&ht->next, NULL, __ATOMIC_RELEASE);
+    ht->migrated = 0;
+}
+
+/* Nodes are never freed, so they are carved from big chunks. Called with
+   the insert lock held */
+static void *
+node_alloc(hashtable_t *ht, size_t size) {
+    size = (size + HASHTABLE_ALIGN - 1) & ~(size_t)(HASHTABLE_ALIGN - 1);
+    if (size > HASHTABLE_CHUNK / 4)
+        return malloc(size);
+    if (size > ht->chunk_left) {
+        ht->chunk = malloc(HASHTABLE_CHUNK);
+        if (!ht->chunk) {
+            ht->chunk_left = 0;
+            return NULL;
+        }
+        ht->chunk_left = HASHTABLE_CHUNK;
     }
+    void *p = ht->chunk;
+    ht->chunk += size;
+    ht->chunk_left -= size;
+    return p;
+}
 
-    return n;
+/* Exports */
+
+/* size slots to begin with, rounded up to a power of two */
+int
+hashtable_new(hashtable_t *ht, int size) {
+    size_t slots = 16;
+    while (slots < (size_t)size)
+        slots <<= 1;
+    memset(ht, 0, sizeof(hashtable_t));
+    ht->index = index_new(slots);
+    if (!ht->index)
+        return -1;
+    pthread_mutex_init(&ht->insert_lock, NULL);
+    for (int i = 0; i < HASHTABLE_STRIPES; i++)
+        pthread_mutex_init(&ht->locks[i], NULL);
+    return 0;
+}
+
+/* Never 0, that marks empty slots */
+uint64_t
+hashtable_hash(const char *key, size_t len) {
+    uint64_t h = wyhash(key, len, 0);
+    return h ? h : 1;
 }
 
+/* Lock-free. Racing an insert that finishes growing the table it may
+   miss a key, hashtable_insert then returns the node already there */
 hashtable_node_t *
-hashtable_nfind(hashtable_t *ht, const char *key, int key_len) {
-    hashtable_node_t *n = ht->table + (hashn(key, key_len) % ht->size);
-lbl:
-    if (n->key_len == 0) {
-        n->key_len = key_len;
-        n->key = malloc(key_len);
-        memcpy((void*)n->key, key, key_len);
+hashtable_hfind(hashtable_t *ht, uint64_t hash, const char *key,
+    size_t len)
+{
+    hashtable_index_t *idx = __atomic_load_n(&ht->index, __ATOMIC_ACQUIRE);
+    hashtable_node_t *n = index_find(idx, hash, key, len);
+    if (n)
         return n;
-    }
-    
-    if (n->key_len != key_len) {
-        if (n->next == NULL) goto new;
-        n = n->next;
-        goto lbl;
-    }
+    /* Inserted since the table started growing */
+    hashtable_index_t *next = __atomic_load_n(&ht->next, __ATOMIC_ACQUIRE);
+    if (next)
+        return index_find(next, hash, key, len);
+    /* Or done growing meanwhile */
+    hashtable_index_t *cur = __atomic_load_n(&ht->index, __ATOMIC_ACQUIRE);
+    if (cur != idx)
+        return index_find(cur, hash, key, len);
+    return NULL;
+}
 
-    if (memcmp(n->key, key, key_len) != 0) {
-        if (n->next == NULL) goto new;
-        n = n->next;
-        goto lbl;
-    } else {
+/* The first insert of a key wins, later ones get its node. NULL out of
+   memory */
+hashtable_node_t *
+hashtable_ninsert(hashtable_t *ht, const char *key, size_t len,
+    htdata_t value)
+{
+    uint64_t hash = hashtable_hash(key, len);
+
+    pthread_mutex_lock(&ht->insert_lock);
+    hashtable_node_t *n = index_find(ht->index, hash, key, len);
+    if (!n && ht->next)
+        n = index_find(ht->next, hash, key, len);
+    if (n) {
+        pthread_mutex_unlock(&ht->insert_lock);
         return n;
     }
-new:
-    n->next = calloc(1, sizeof(hashtable_node_t));
-    goto lbl;
-}
 
-hashtable_node_t *
-hashtable_ninsert(hashtable_t *ht, const char *key, 
-                       int key_len, htdata_t value) {
-    
-    hashtable_node_t *n = hashtable_nfind(ht, key, key_len);
+    /* Grow at half full, or finish growing before the next one */
+    hashtable_index_t *idx = ht->next ? ht->next : ht->index;
+    if (idx->used + 1 > (idx->mask + 1) / 2) {
+        if (ht->next)
+            migrate(ht, SIZE_MAX);
+        ht->next = index_new((ht->index->mask + 1) * 2);
+        /* Still room enough to carry on without */
+        if (!ht->next && ht->index->used + 1 > (ht->index->mask + 1) * 3 / 4) {
+            pthread_mutex_unlock(&ht->insert_lock);
+            return NULL;
+        }
+        idx = ht->next ? ht->next : ht->index;
+    }
+
+    n = node_alloc(ht, sizeof(hashtable_node_t) + len + 1);
+    if (!n) {
+        pthread_mutex_unlock(&ht->insert_lock);
+        return NULL;
+    }
+    n->hash = hash;
+    n->key_len = len;
+    memcpy(n->key, key, len);
+    n->key[len] = '\0';
     n->data = value;
+    n->all = ht->all;
+    __atomic_store_n(&ht->all, n, __ATOMIC_RELEASE);
+    index_put(idx, n);
+    if (ht->next)
+        migrate(ht, HASHTABLE_MIGRATE);
+    pthread_mutex_unlock(&ht->insert_lock);
     return n;
 }
 
@@ -109,9 +293,16 @@ hashtable_insert(hashtable_t *ht, const char *key, htdata_t value) {
     return hashtable_ninsert(ht, key, strlen(key), value);
 }
 
+hashtable_node_t *
+hashtable_find(hashtable_t *ht, const char *key) {
+    size_t len = strlen(key);
+    return hashtable_hfind(ht, hashtable_hash(key, len), key, len);
+}
+
 htdata_t *
-hashtable_nget(hashtable_t *ht, const char *key, int key_len) {
-    hashtable_node_t *n = hashtable_rnfind(ht, key, key_len);
+hashtable_nget(hashtable_t *ht, const char *key, size_t len) {
+    hashtable_node_t *n = hashtable_hfind(ht, hashtable_hash(key, len), key,
+        len);
     if (n == NULL) return NULL;
     return &n->data;
 }
@@ -121,29 +312,19 @@ hashtable_get(hashtable_t *ht, const char *key) {
     return hashtable_nget(ht, key, strlen(key));
 }
 
+/* Newest node, the rest follow through all */
+hashtable_node_t *
+hashtable_first(hashtable_t *ht) {
+    return __atomic_load_n(&ht->all, __ATOMIC_ACQUIRE);
+}
 
-/*
-int main(void) {
-    int *tmp;
-    struct hashtable tbl;
-
-    const char *strings[] = {"balls balls", "balls", "sex", "jimmy", "george", "lenny is the coolest"};
-    const int values[] = {69, 420, 421, 469, 42, 22};
-
-    hashtable_new(&tbl, 64);
-
-    struct timespec t1 = {0}, t2 = {0};
-    for (int i = 0; i < 6; i++) {
-        
-        hashtable_insert(&tbl, strings[i], values[i]);
-
-        printf("insert '%s' -> %d took %luns\n", strings[i], values[i], t2.tv_nsec-t1.tv_nsec);
-    }
-
-    for (int i = 0; i < 6; i++) {
-
-        tmp = qget(&tbl, strings[i]);
+/* Serialise writers of a node's data */
+void
+hashtable_lock(hashtable_t *ht, const hashtable_node_t *n) {
+    pthread_mutex_lock(&ht->locks[n->hash % HASHTABLE_STRIPES]);
+}
 
-        printf("get '%s' -> %d took %luns\n", strings[i], *tmp, t2.tv_nsec-t1.tv_nsec);
-    }
-}*/
+void
+hashtable_unlock(hashtable_t *ht, const hashtable_node_t *n) {
+    pthread_mutex_unlock(&ht->locks[n->hash % HASHTABLE_STRIPES]);
+}
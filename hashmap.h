@@ -18,38 +18,98 @@
 
 */
 
+#ifndef _HASHMAP_H
+#define _HASHMAP_H
+
 #include <sys/stat.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Entry updates take the lock of the stripe the key hashes to, inserts
+   the table's, lookups none */
+#define HASHTABLE_STRIPES   64
 
-/* 10
-   CS */
 #define IS_CACHED_STAT(x)       (x & 1)
-#define IS_CACHED_CONTENT(x)    ((x >> 1) & 1)
 #define SET_CACHED_STAT(x)      (x |= 1)
-#define SET_CACHED_CONTENT(x)   (x |= 1 << 1)
 #define CLEAR_CACHED_STAT(x)    (x &= ~(1))
-#define CLEAR_CACHED_CONTENT(x) (x &= ~(1 << 1))
+
+struct cached_fd_s;
+struct cached_content_s;
+struct autoindex_s;
+
+/* What requests use of a stat, a struct stat is 144 bytes */
+typedef struct {
+    ino_t ino;
+    off_t size;
+    struct timespec mtim;
+    mode_t mode;
+} htstat_t;
 
 typedef struct nodedata_s {
-    struct stat stat_data;
-    char *content_buff;
-    size_t content_size;
+    htstat_t stat_data;
+    unsigned int seq;   /* odd while stat_data is being written */
+    int wd; /* inotify watch fd, -1 once it went with the inode */
+    struct hashtable_node_s *wd_next;   /* watch index chain */
     char flags;
-    int wd; /* inotify watch fd */
+    struct cached_content_s *content;   /* shared mapping, swapped whole */
+    const char *mime_type;          /* resolved once, static or interned */
+    struct autoindex_s *listing;    /* directories, read once */
+    struct cached_fd_s *open_fd;    /* open file cache */
+    struct nodedata_s *fd_prev;     /* open file LRU, oldest first */
+    struct nodedata_s *fd_next;
 } htdata_t;
 
+/* Published fully built and never moved or removed, so pointers to it
+   stay good and readers need no lock */
 typedef struct hashtable_node_s {
-    struct hashtable_node_s *next;
-    const char *key;
-    int key_len;
+    uint64_t hash;
+    struct hashtable_node_s *all;   /* every node, newest first */
+    size_t key_len;
     htdata_t data;
+    char key[];                     /* NUL terminated */
 } hashtable_node_t;
 
+/* Open addressing with linear probing. A slot is written once, node
+   first, then the hash that marks it used */
+typedef struct {
+    uint64_t hash;                  /* 0 = empty */
+    hashtable_node_t *node;
+} hashtable_slot_t;
+
+typedef struct hashtable_index_s {
+    size_t mask;                    /* slots - 1 */
+    size_t used;
+    struct hashtable_index_s *retired;  /* outgrown, kept for readers */
+    hashtable_slot_t slots[];
+} hashtable_index_t;
+
+/* Grown by doubling, a few slots copied per insert. Until all are, keys
+   are looked up in index and then next */
 typedef struct hashtable_s {
-    hashtable_node_t *table;
-    int size;
+    hashtable_index_t *index;
+    hashtable_index_t *next;        /* being grown into, or NULL */
+    size_t migrated;                /* slots of index copied to next */
+    hashtable_node_t *all;
+    char *chunk;                    /* nodes are carved from chunks */
+    size_t chunk_left;
+    pthread_mutex_t insert_lock;
+    pthread_mutex_t locks[HASHTABLE_STRIPES];
 } hashtable_t;
 
-void hashtable_new(hashtable_t *ht, int size);
+int hashtable_new(hashtable_t *ht, int size);
+uint64_t hashtable_hash(const char *key, size_t len);
+hashtable_node_t *hashtable_hfind(hashtable_t *ht, uint64_t hash,
+    const char *key, size_t len);
 hashtable_node_t *hashtable_insert(hashtable_t *ht, const char *key, htdata_t value);
+hashtable_node_t *hashtable_ninsert(hashtable_t *ht, const char *key,
+    size_t len, htdata_t value);
+hashtable_node_t *hashtable_find(hashtable_t *ht, const char *key);
 htdata_t *hashtable_get(hashtable_t *ht, const char *key);
+htdata_t *hashtable_nget(hashtable_t *ht, const char *key, size_t len);
+hashtable_node_t *hashtable_first(hashtable_t *ht);
+void hashtable_lock(hashtable_t *ht, const hashtable_node_t *n);
+void hashtable_unlock(hashtable_t *ht, const hashtable_node_t *n);
+
+#endif
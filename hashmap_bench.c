@@ -0,0 +1,204 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    hashmap_bench.c: File cache table microbenchmark, against the chained
+    table it replaced
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "hashmap.h"
+
+#define BENCH_LOOKUPS   2000000
+#define OLD_SIZE        65536   /* buckets, fixed */
+
+/* The table as it was: 31 multiplier hash, fixed bucket array, calloced
+   collision nodes, full struct stat per entry */
+typedef struct {
+    struct stat stat_data;
+    char *content_buff;
+    size_t content_size;
+    char flags;
+    int wd;
+    const char *mime_type;
+    void *listing;
+    void *open_fd;
+    void *fd_prev;
+    void *fd_next;
+} old_data_t;
+
+typedef struct old_node_s {
+    struct old_node_s *next;
+    const char *key;
+    int key_len;
+    old_data_t data;
+} old_node_t;
+
+typedef struct {
+    old_node_t *table;
+    int size;
+} old_table_t;
+
+static uint64_t
+old_hashn(const char *str, int len) {
+    uint64_t out = 7;
+    for (int i = 0; i < len; i++) {
+        out = (out * 31) + str[i];
+    }
+    return out;
+}
+
+void
+old_new(old_table_t *ht, int size) {
+    ht->table = calloc(size, sizeof(old_node_t));
+    ht->size = size;
+}
+
+old_node_t *
+old_rnfind(old_table_t *ht, const char *key, int key_len) {
+    old_node_t *n = ht->table + (old_hashn(key, key_len) % ht->size);
+    for (; n && n->key_len; n = n->next)
+        if (n->key_len == key_len && memcmp(n->key, key, key_len) == 0)
+            return n;
+    return NULL;
+}
+
+old_node_t *
+old_insert(old_table_t *ht, const char *key, old_data_t value) {
+    int key_len = strlen(key);
+    old_node_t *n = ht->table + (old_hashn(key, key_len) % ht->size);
+    while (n->key_len) {
+        if (n->key_len == key_len && memcmp(n->key, key, key_len) == 0)
+            break;
+        if (!n->next)
+            n->next = calloc(1, sizeof(old_node_t));
+        n = n->next;
+    }
+    if (!n->key_len) {
+        n->key_len = key_len;
+        n->key = malloc(key_len);
+        memcpy((void*)n->key, key, key_len);
+    }
+    n->data = value;
+    return n;
+}
+
+old_data_t *
+old_get(old_table_t *ht, const char *key) {
+    old_node_t *n = old_rnfind(ht, key, strlen(key));
+    return n ? &n->data : NULL;
+}
+
+double
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Webroot like paths, realpath'd */
+char **
+make_keys(int n, const char *prefix) {
+    char **keys = malloc(n * sizeof(char*));
+    char buff[256];
+    for (int i = 0; i < n; i++) {
+        snprintf(buff, sizeof(buff), "/srv/www/%s/assets/%04d/img_%06d.png",
+            prefix, i / 100, i);
+        keys[i] = strdup(buff);
+    }
+    return keys;
+}
+
+/* Lookups in a fixed pseudo-random order */
+int *
+make_order(int n) {
+    int *order = malloc(BENCH_LOOKUPS * sizeof(int));
+    uint64_t x = 88172645463325252ull;
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        order[i] = x % n;
+    }
+    return order;
+}
+
+void
+bench(int n) {
+    char **keys = make_keys(n, "static");
+    char **misses = make_keys(n, "missing");
+    int *order = make_order(n);
+    size_t check = 0;
+    double start, insert_ns[2], hit_ns[2], miss_ns[2];
+
+    old_table_t old;
+    old_data_t old_value = { 0 };
+    old_new(&old, OLD_SIZE);
+    start = now_ns();
+    for (int i = 0; i < n; i++)
+        old_insert(&old, keys[i], old_value);
+    insert_ns[0] = (now_ns() - start) / n;
+    start = now_ns();
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+        check += old_get(&old, keys[order[i]]) != NULL;
+    hit_ns[0] = (now_ns() - start) / BENCH_LOOKUPS;
+    start = now_ns();
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+        check += old_get(&old, misses[order[i]]) == NULL;
+    miss_ns[0] = (now_ns() - start) / BENCH_LOOKUPS;
+
+    hashtable_t ht;
+    htdata_t value = { 0 };
+    hashtable_new(&ht, 4096);
+    start = now_ns();
+    for (int i = 0; i < n; i++)
+        hashtable_insert(&ht, keys[i], value);
+    insert_ns[1] = (now_ns() - start) / n;
+    start = now_ns();
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+        check += hashtable_get(&ht, keys[order[i]]) != NULL;
+    hit_ns[1] = (now_ns() - start) / BENCH_LOOKUPS;
+    start = now_ns();
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+        check += hashtable_get(&ht, misses[order[i]]) == NULL;
+    miss_ns[1] = (now_ns() - start) / BENCH_LOOKUPS;
+
+    if (check != 4 * BENCH_LOOKUPS) printf("lookup failed\n");
+
+    const char *names[2] = { "chained", "open" };
+    for (int t = 0; t < 2; t++)
+        printf("%-8d %-8s %10.1f %10.1f %10.1f\n", n, names[t],
+            insert_ns[t], hit_ns[t], miss_ns[t]);
+    printf("%-8d %-8s %9zuB %9zuB\n", n, "entry", sizeof(old_node_t),
+        sizeof(hashtable_node_t));
+}
+
+int
+main(void) {
+    int sizes[] = { 1000, 50000, 500000 };
+    printf("%-8s %-8s %10s %10s %10s\n", "keys", "table", "insert ns",
+        "hit ns", "miss ns");
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+        bench(sizes[i]);
+    return 0;
+}
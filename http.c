@@ -20,11 +20,20 @@
 
 */
 
+#define _GNU_SOURCE /* strptime, timegm */
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
@@ -36,18 +45,29 @@
 #include <dirent.h>
 #include <errno.h>
 
-#include <magic.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "strutils.h"
 #include "log.h"
 #include "cache.h"
+#include "uring.h"
+#include "arena.h"
+#include "autoindex.h"
+#include "pool.h"
 
 #include "http.h"
 
 
 #define USE_CACHE
 
+#define SEND_TIMEOUT    30000 /* ms to wait for a full send buffer */
+#define LOG_LINE_SIZE   1024
+#define TLS_RECORD_SIZE 16384 /* max TLS plaintext record */
+#define RANGES_MAX      16    /* more and the whole file is sent */
+#define HTTP_DATE_LEN   29
+#define AUTOINDEX_HEAD_SIZE (8 * 1024)
+
 #ifndef USE_CACHE
 #  define CACHED_FILE       FILE  
 #  define cached_stat       stat  
@@ -56,119 +76,488 @@
 #  define cached_fclose     fclose
 #endif
 
+/* "Date: " IMF-fixdate CRLF, always this long */
+#define DATE_HEADER_LEN 37
 
-char sendbuff[BUFF_SIZE];
-char logbuff[1024];
-char endpoint[1024];
-
-static magic_t magic_cookie = NULL;
-
-#define AUTOINDEX_INTRO \
-"<!DOCTYPE html>\n" \
-"<html>\n" \
-"  <head>\n" \
-"    <style>\n" \
-"    table, th, td {\n" \
-"      border: 1px solid;\n" \
-"    }\n" \
-"    </style>\n" \
-"  </head>\n" \
-"  <body>\n" \
-"    <h1>Index Of %s</h1>\n" \
-"    <hr>\n" \
-"    <table>\n" \
-"      <tr>\n" \
-"        <th>Name</th>\n" \
-"        <th>Size</th>\n" \
-"        <th>Type</th>\n" \
-"        <th>Date</th>\n" \
-"      </tr>\n"
-
-#define AUTOINDEX_OUTRO \
-"    </table>\n" \
-"  </body>\n" \
-"</html>\n"
 
+/* Rendered once a second by the clock thread, readers pick up the slot
+   last published */
+static char date_headers[2][DATE_HEADER_LEN + 1];
+static int date_current = 0;
 
+/* Scratch space of the request being handled, carved from the handling
+   thread's arena and dropped with it once the response is queued */
+typedef struct {
+    client_t *cs;
+    arena_t *arena;
+    strbuf_t headers;   /* response head after the status line */
+    strbuf_t log;       /* access log line */
+} http_ctx_t;
 
-int
-strlencrlf(const char *str) {
-    const char *ptr = str;
-    int size = 0;
-    while (*ptr != '\0') {
-        if (*ptr == '\n') size++;
-        size++;
-        ptr++;
-    }
-    return size;
+typedef struct {
+    off_t first;
+    off_t last;         /* inclusive */
+} http_range_t;
+
+
+
+void
+cs_init(client_t *cs, int fd, struct tls *ctx, char *addrstr) {
+    cs->fd = fd;
+    cs->ctx = ctx;
+    cs->addrstr = addrstr;
+    cs->uring = NULL;
+    cs->requests = 0;
+    cs->keepalive = 0;
+    cs->pooled = 0;
+    http_parser_init(&cs->req);
+    cs->discard = 0;
+    cs->out.iovcnt = 0;
+    cs->out.len = 0;
+    cs->out.nheld = 0;
+    cs->nonblock = 0;
+    cs->pending = NULL;
+    cs->pending_tail = NULL;
+}
+
+/* Pending output */
+http_pending_t *
+pending_push(client_t *cs, size_t size) {
+    http_pending_t *p = malloc(sizeof(http_pending_t) + size);
+    if (!p)
+        return NULL;
+    p->next = NULL;
+    p->ptr = p->data;
+    p->len = 0;
+    p->content = NULL;
+    p->cfd = NULL;
+    p->off = 0;
+    if (cs->pending_tail) cs->pending_tail->next = p;
+    else cs->pending = p;
+    cs->pending_tail = p;
+    return p;
 }
 
 void
-convertcrlf(char *buff, size_t size) {
-    size_t bufflen = strlen(buff) + 1;
-    char *ptr = buff;
-
-    while (*ptr) {
-        char *p = strchr(ptr, '\n');
-        /* walked past last occurrence of needle or run out of buffer */
-        if (p == NULL || bufflen + 1 >= size || p >= buff + size) {
-            break;
+pending_pop(client_t *cs) {
+    http_pending_t *p = cs->pending;
+    cs->pending = p->next;
+    if (!cs->pending)
+        cs->pending_tail = NULL;
+    if (p->content)
+        cached_content_release(p->content);
+    if (p->cfd)
+        cached_fd_close(p->cfd);
+    free(p);
+}
+
+/* Drop n bytes that went out */
+void
+pending_consume(client_t *cs, size_t n) {
+    while (n > 0 && cs->pending) {
+        http_pending_t *p = cs->pending;
+        if (n < p->len) {
+            if (p->cfd)
+                p->off += n;
+            else
+                p->ptr += n;
+            p->len -= n;
+            return;
         }
+        n -= p->len;
+        pending_pop(cs);
+    }
+}
 
-        /* move part after lf */
-        memmove(p + 1, p, bufflen - (p - buff));
+/* Cached mapping queued data points into, if any */
+CACHED_CONTENT *
+out_holder(const http_out_t *out, const char *ptr) {
+    for (int i = 0; i < out->nheld; i++) {
+        const CACHED_CONTENT *c = out->held[i];
+        if (ptr >= c->buff && ptr < c->buff + c->size)
+            return out->held[i];
+    }
+    return NULL;
+}
 
-        /* insert cr */
-        *p = '\r';
+/* Keep what the socket would not take for cs_drain. Cached mappings are
+   referenced, everything else is copied since it goes with the request */
+int
+cs_pend(client_t *cs, const struct iovec *iov, int iovcnt) {
+    const http_out_t *out = &cs->out;
+    int i = 0;
+    while (i < iovcnt) {
+        CACHED_CONTENT *content = out_holder(out, iov[i].iov_base);
+        size_t n = iov[i].iov_len;
+        int j = i + 1;
+        /* Copies in a row share a segment */
+        if (!content) {
+            for (; j < iovcnt && !out_holder(out, iov[j].iov_base); j++)
+                n += iov[j].iov_len;
+        }
 
-        bufflen++;
-        ptr = p + 2;
+        http_pending_t *p = pending_push(cs, content ? 0 : n);
+        if (!p) {
+            errno = ENOMEM;
+            return -1;
+        }
+        p->len = n;
+        if (content) {
+            cached_content_ref(content);
+            p->content = content;
+            p->ptr = iov[i].iov_base;
+        } else {
+            char *dst = p->data;
+            for (int k = i; k < j; k++) {
+                memcpy(dst, iov[k].iov_base, iov[k].iov_len);
+                dst += iov[k].iov_len;
+            }
+        }
+        i = j;
     }
+    return 0;
 }
 
+/* Keep the rest of a file for cs_drain to sendfile */
+int
+cs_pend_file(client_t *cs, CACHED_FD *cfd, off_t off, size_t count) {
+    http_pending_t *p = pending_push(cs, 0);
+    if (!p) {
+        errno = ENOMEM;
+        return -1;
+    }
+    cached_fd_ref(cfd);
+    p->cfd = cfd;
+    p->off = off;
+    p->len = count;
+    return 0;
+}
 
-const char *
-find_field(const char *str) {
-    const char *field = strchr(str, ' ');
-    if (!field) return NULL;
-    return field + 1;
+/* Write out what nonblock connections left pending. 0 once all of it is
+   out, TLS_WANT_POLLIN or TLS_WANT_POLLOUT when the socket has to be
+   ready first, -1 on error */
+int
+cs_drain(client_t *cs) {
+    while (cs->pending) {
+        ssize_t r;
+        if (cs->ctx) {
+            /* Retried with the same bytes after a WANT, as libtls needs */
+            r = tls_write(cs->ctx, cs->pending->ptr, cs->pending->len);
+            if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+                return r;
+            if (r < 0) {
+                console_log(LOG_DBG, cs->addrstr, "TLS write: ",
+                    tls_error(cs->ctx));
+                return -1;
+            }
+        } else if (cs->pending->cfd) {
+            off_t off = cs->pending->off;
+            r = sendfile(cs->fd, cs->pending->cfd->fd, &off,
+                cs->pending->len);
+            if (r == 0) {
+                /* Truncated under us, can't make up for Content-Length */
+                console_log(LOG_ERR, cs->addrstr, "File truncated", NULL);
+                return -1;
+            }
+        } else {
+            /* Everything up to the next file in one go */
+            struct iovec iov[OUT_IOV_MAX];
+            int iovcnt = 0;
+            http_pending_t *p = cs->pending;
+            for (; p && !p->cfd && iovcnt < OUT_IOV_MAX; p = p->next) {
+                iov[iovcnt].iov_base = (void*)p->ptr;
+                iov[iovcnt].iov_len = p->len;
+                iovcnt++;
+            }
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+            r = sendmsg(cs->fd, &msg,
+                MSG_NOSIGNAL | MSG_DONTWAIT | (p && p->cfd ? MSG_MORE : 0));
+        }
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return TLS_WANT_POLLOUT;
+            console_log(LOG_ERR, cs->addrstr, "Error sending: ",
+                strerror(errno));
+            return -1;
+        }
+        pending_consume(cs, r);
+    }
+    return 0;
 }
 
+/* libtls writes partially, a record at a time. Nonblock connections leave
+   what it won't take yet pending, for cs_drain to retry */
+int
+cs_tls_write(client_t *cs, const void *buf, size_t n) {
+    size_t sent = 0;
+    struct iovec rest;
+    /* Behind earlier output */
+    if (cs->pending) {
+        rest.iov_base = (void*)buf;
+        rest.iov_len = n;
+        return cs_pend(cs, &rest, 1);
+    }
+    while (sent < n) {
+        ssize_t r = tls_write(cs->ctx, (const char*)buf + sent, n - sent);
+        if ((r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT) && cs->nonblock) {
+            rest.iov_base = (char*)buf + sent;
+            rest.iov_len = n - sent;
+            if (cs_pend(cs, &rest, 1) < 0)
+                return -1;
+            return sent;
+        } else if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT) {
+            struct pollfd pfd = { .fd = cs->fd,
+                .events = r == TLS_WANT_POLLIN ? POLLIN : POLLOUT };
+            if (poll(&pfd, 1, SEND_TIMEOUT) > 0)
+                continue;
+            errno = ETIMEDOUT;
+            return -1;
+        } else if (r < 0) {
+            console_log(LOG_DBG, cs->addrstr, "TLS write: ",
+                tls_error(cs->ctx));
+            errno = EIO;
+            return -1;
+        }
+        sent += r;
+    }
+    return sent;
+}
 
-const char *
-get_mime_type(const char *path) {
-    if (!magic_cookie) {
-        magic_cookie = magic_open(MAGIC_MIME_TYPE);
-        if (!magic_cookie) {
-            console_log(LOG_ERR, NULL, "Error magic_opening: ",
-                strerror(errno));
-            return NULL;
+/* Plain sockets, consumes iov. Partial writes wait for room and push the
+   rest, except on nonblock connections which leave it pending instead */
+int
+cs_writev(client_t *cs, struct iovec *iov, int iovcnt, int flags) {
+    size_t sent = 0;
+    /* Behind earlier output */
+    if (cs->pending)
+        return cs_pend(cs, iov, iovcnt);
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t r = sendmsg(cs->fd, &msg, MSG_NOSIGNAL | flags);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && cs->nonblock) {
+                if (cs_pend(cs, iov, iovcnt) < 0)
+                    return -1;
+                return sent;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = cs->fd, .events = POLLOUT };
+                if (poll(&pfd, 1, SEND_TIMEOUT) > 0)
+                    continue;
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+        sent += r;
+        /* Skip what went out */
+        while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-        if (magic_load(magic_cookie, NULL) < 0) {
-            console_log(LOG_ERR, NULL, "Error magic_loading: ",
-                magic_error(magic_cookie));
-            magic_close(magic_cookie);
-            return NULL;
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + r;
+            iov->iov_len -= r;
         }
     }
-    
-    const char *mimestr = magic_file(magic_cookie, path);
-    return mimestr;
+    return sent;
 }
 
+/* Write out now, returns n or -1 */
 int
-cs_send(const client_t *cs, const void *buf, size_t n, int flags) {
-    if (cs->ctx) {
-        return tls_write(cs->ctx, buf, n);
+cs_write(client_t *cs, const void *buf, size_t n) {
+    if (cs->uring) {
+        return uring_send(cs->uring, buf, n, 1);
+    } else if (cs->ctx) {
+        return cs_tls_write(cs, buf, n) < 0 ? -1 : (int)n;
     } else {
-        return send(cs->fd, buf, n, flags);
+        struct iovec iov = { .iov_base = (void*)buf, .iov_len = n };
+        return cs_writev(cs, &iov, 1, 0) < 0 ? -1 : (int)n;
     }
 }
 
+/* Small pieces are packed into full records rather than each being
+   encrypted and sent in a record of its own, big ones go straight from
+   where they are. Once a nonblock connection backs up, the records left
+   are kept pending as they were packed */
 int
-cs_close(const client_t *cs) {
-    if (cs->ctx) {
-        return tls_close(cs->ctx);
+cs_tls_flush(client_t *cs) {
+    const http_out_t *out = &cs->out;
+    char stage[TLS_RECORD_SIZE];
+    size_t staged = 0;
+
+    for (int i = 0; i < out->iovcnt; i++) {
+        const char *base = out->iov[i].iov_base;
+        size_t len = out->iov[i].iov_len;
+        while (len > 0) {
+            if (staged == 0 && len >= TLS_RECORD_SIZE) {
+                if (cs_tls_write(cs, base, len) < 0)
+                    return -1;
+                break;
+            }
+            size_t take = TLS_RECORD_SIZE - staged;
+            if (take > len) take = len;
+            memcpy(stage + staged, base, take);
+            staged += take;
+            base += take;
+            len -= take;
+            if (staged == TLS_RECORD_SIZE) {
+                if (cs_tls_write(cs, stage, staged) < 0)
+                    return -1;
+                staged = 0;
+            }
+        }
+    }
+    if (staged > 0 && cs_tls_write(cs, stage, staged) < 0)
+        return -1;
+    return 0;
+}
+
+/* Write everything queued in one go, flags for plain sockets */
+int
+cs_flush_flags(client_t *cs, int flags) {
+    http_out_t *out = &cs->out;
+    int r = 0;
+    if (out->iovcnt == 0)
+        return 0;
+
+    if (cs->uring) {
+        r = uring_sendv(cs->uring, out->iov, out->iovcnt, out->buff,
+            out->len, out->held, out->nheld);
+        /* The ring lets go of them when the send completes */
+        if (r >= 0)
+            out->nheld = 0;
+    } else if (cs->ctx) {
+        r = cs_tls_flush(cs);
+    } else {
+        r = cs_writev(cs, out->iov, out->iovcnt, flags);
+    }
+
+    for (int i = 0; i < out->nheld; i++)
+        cached_content_release(out->held[i]);
+    out->iovcnt = 0;
+    out->len = 0;
+    out->nheld = 0;
+    if (r < 0)
+        console_log(LOG_ERR, cs->addrstr, "Error sending: ", strerror(errno));
+    return r;
+}
+
+int
+cs_flush(client_t *cs) {
+    return cs_flush_flags(cs, 0);
+}
+
+/* Send count bytes of cfd from off straight from the page cache, plain
+   sockets only. Whatever is queued goes first, in the same segment as the
+   start of the file. Nonblock connections leave what the socket won't
+   take pending */
+int
+cs_sendfile(client_t *cs, CACHED_FD *cfd, off_t off, size_t count) {
+    if (cs_flush_flags(cs, MSG_MORE) < 0)
+        return -1;
+    /* Behind earlier output */
+    if (cs->pending)
+        return cs_pend_file(cs, cfd, off, count);
+
+    while (count > 0) {
+        ssize_t r = sendfile(cs->fd, cfd->fd, &off, count);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && cs->nonblock) {
+                return cs_pend_file(cs, cfd, off, count);
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = cs->fd, .events = POLLOUT };
+                if (poll(&pfd, 1, SEND_TIMEOUT) > 0)
+                    continue;
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        } else if (r == 0) {
+            /* Truncated under us, can't make up for Content-Length */
+            errno = EIO;
+            return -1;
+        }
+        count -= r;
+    }
+    return 0;
+}
+
+/* Queue for the next cs_flush. Mapped memory outlives the request (cache
+   mappings) and is referenced instead of copied */
+int
+cs_queue(client_t *cs, const void *buf, size_t n, int mapped) {
+    http_out_t *out = &cs->out;
+
+    if ((!mapped && n > OUT_BUFF_SIZE - out->len) ||
+        out->iovcnt == OUT_IOV_MAX)
+    {
+        if (cs_flush(cs) < 0)
+            return -1;
+        /* Too big to batch */
+        if (!mapped && n > OUT_BUFF_SIZE)
+            return cs_write(cs, buf, n);
+    }
+
+    if (!mapped) {
+        char *dst = out->buff + out->len;
+        memcpy(dst, buf, n);
+        out->len += n;
+        /* Extend the previous copy */
+        if (out->iovcnt > 0) {
+            struct iovec *last = out->iov + out->iovcnt - 1;
+            if ((char*)last->iov_base + last->iov_len == dst) {
+                last->iov_len += n;
+                return n;
+            }
+        }
+        buf = dst;
+    }
+
+    out->iov[out->iovcnt].iov_base = (void*)buf;
+    out->iov[out->iovcnt].iov_len = n;
+    out->iovcnt++;
+    return n;
+}
+
+int
+cs_send(client_t *cs, const void *buf, size_t n) {
+    return cs_queue(cs, buf, n, 0);
+}
+
+int
+cs_send_mapped(client_t *cs, const void *buf, size_t n) {
+    return cs_queue(cs, buf, n, 1);
+}
+
+/* Queue part of a cached mapping, which stays mapped until it's written */
+int
+cs_send_content(client_t *cs, CACHED_CONTENT *content, off_t off, size_t n) {
+    if (n == 0)
+        return 0;
+    int r = cs_send_mapped(cs, content->buff + off, n);
+    if (r < 0)
+        return r;
+    cached_content_ref(content);
+    cs->out.held[cs->out.nheld++] = content;
+    return r;
+}
+
+int
+cs_close(client_t *cs) {
+    while (cs->pending)
+        pending_pop(cs);
+    if (cs->uring) {
+        return uring_close(cs->uring);
+    } else if (cs->ctx) {
+        int r = tls_close(cs->ctx);
+        tls_free(cs->ctx);
+        close(cs->fd);
+        return r;
     } else {
         return close(cs->fd);
     }
@@ -177,117 +566,524 @@ cs_close(const client_t *cs) {
 
 
 /* Status */
+/* Bodyless responses and status lines are constant, they are queued by
+   reference rather than rendered per request */
+#define STATUS_RESPONSE(status, conn) \
+    "HTTP/1.1 " status "\r\nContent-Length: 0\r\nConnection: " conn "\r\n\r\n"
+#define STATUS_CONST(s)     { s, sizeof(s) - 1 }
+#define STATUS_RESPONSES(status) { \
+    STATUS_CONST(STATUS_RESPONSE(status, "close")), \
+    STATUS_CONST(STATUS_RESPONSE(status, "keep-alive")) }
+
+typedef struct {
+    const char *str;
+    size_t len;
+} status_const_t;
+
+static const status_const_t status_200 = STATUS_CONST("HTTP/1.1 200 OK\r\n");
+static const status_const_t status_206 =
+    STATUS_CONST("HTTP/1.1 206 Partial Content\r\n");
+static const status_const_t status_304 =
+    STATUS_CONST("HTTP/1.1 304 Not Modified\r\n");
+static const status_const_t status_416 =
+    STATUS_CONST("HTTP/1.1 416 Range Not Satisfiable\r\n");
+static const status_const_t status_400[2] = STATUS_RESPONSES("400 Bad Request");
+static const status_const_t status_403[2] = STATUS_RESPONSES("403 Forbidden");
+static const status_const_t status_404[2] = STATUS_RESPONSES("404 Not Found");
+static const status_const_t status_414[2] =
+    STATUS_RESPONSES("414 URI Too Long");
+static const status_const_t status_431[2] =
+    STATUS_RESPONSES("431 Request Header Fields Too Large");
+static const status_const_t status_501[2] =
+    STATUS_RESPONSES("501 Not Implemented");
+static const status_const_t status_503[2] =
+    STATUS_RESPONSES("503 Service Unavailable");
+
 void
-send404(const client_t *cs) {
-    snprintf(sendbuff, BUFF_SIZE, "HTTP/1.1 404 Not Found\n\n");
-    convertcrlf(sendbuff, BUFF_SIZE);
-    if (cs_send(cs, sendbuff, strlen(sendbuff), 0) < 0) {
+sendstatus(client_t *cs, const status_const_t *status) {
+    const status_const_t *resp = &status[cs->keepalive != 0];
+    if (cs_send_mapped(cs, resp->str, resp->len) < 0) {
         console_log(LOG_ERR, cs->addrstr, "Error sending: ", strerror(errno));
     }
 }
 
 void
-send403(const client_t *cs) {
-    snprintf(sendbuff, BUFF_SIZE, "HTTP/1.1 403 Forbidden\n\n");
-    convertcrlf(sendbuff, BUFF_SIZE);
-    if (cs_send(cs, sendbuff, strlen(sendbuff), 0) < 0) {
-        console_log(LOG_ERR, cs->addrstr, "Error sending: ", strerror(errno));
-    }
+send404(client_t *cs) {
+    sendstatus(cs, status_404);
 }
 
 void
-send501(const client_t *cs) {
-    snprintf(sendbuff, BUFF_SIZE, "HTTP/1.1 501 Not Implemented\n\n");
-    convertcrlf(sendbuff, BUFF_SIZE);
-    if (cs_send(cs, sendbuff, strlen(sendbuff), 0) < 0) {
-        console_log(LOG_ERR, cs->addrstr, "Error sending: ", strerror(errno));
-    }
+send403(client_t *cs) {
+    sendstatus(cs, status_403);
 }
 
 void
-send503(const client_t *cs) {
-    snprintf(sendbuff, BUFF_SIZE, "HTTP/1.1 503 Service Unavailable\n\n");
-    convertcrlf(sendbuff, BUFF_SIZE);
-    if (cs_send(cs, sendbuff, strlen(sendbuff), 0) < 0) {
-        console_log(LOG_ERR, cs->addrstr, "Error sending: ", strerror(errno));
-    }
+send400(client_t *cs) {
+    sendstatus(cs, status_400);
 }
 
 void
-send200(const client_t *cs, const char *headers) {
-    snprintf(sendbuff, BUFF_SIZE, "HTTP/1.1 200 OK\n");
-    if (headers)
-        strlcat(sendbuff, headers, BUFF_SIZE);
-    strlcat(sendbuff, "\n", BUFF_SIZE);
-    convertcrlf(sendbuff, BUFF_SIZE);
-    if (cs_send(cs, sendbuff, strlen(sendbuff), 0) < 0) {
+send414(client_t *cs) {
+    sendstatus(cs, status_414);
+}
+
+void
+send431(client_t *cs) {
+    sendstatus(cs, status_431);
+}
+
+void
+send501(client_t *cs) {
+    sendstatus(cs, status_501);
+}
+
+void
+send503(client_t *cs) {
+    sendstatus(cs, status_503);
+}
+
+/* Status line and location headers go by reference, only what varies
+   per response is copied */
+void
+sendhead(http_ctx_t *ctx, const location_node_t *location,
+    const status_const_t *status)
+{
+    client_t *cs = ctx->cs;
+    strbuf_t *headers = &ctx->headers;
+    int date = __atomic_load_n(&date_current, __ATOMIC_ACQUIRE);
+    strbuf_append(headers, date_headers[date], DATE_HEADER_LEN);
+    if (cs->keepalive)
+        strbuf_lit(headers, "Connection: keep-alive\r\n\r\n");
+    else
+        strbuf_lit(headers, "Connection: close\r\n\r\n");
+    if (cs_send_mapped(cs, status->str, status->len) < 0 ||
+        (location->headerslen > 0 && cs_send_mapped(cs, location->headers,
+            location->headerslen) < 0) ||
+        cs_send(cs, headers->buff, headers->len) < 0)
+    {
         console_log(LOG_ERR, cs->addrstr, "Error sending: ", strerror(errno));
     }
 }
 
+/* IMF-fixdate, HTTP_DATE_LEN long */
 void
-sendautoindex(const client_t *cs, DIR *dir, const char *path,
-    const char *endpoint)
+http_date(time_t t, char *buff) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buff, HTTP_DATE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Byte ranges of a "bytes=" Range value, clamped to size. Returns how
+   many, 0 when none can be satisfied and -1 when the header is to be
+   ignored and the whole file sent */
+int
+http_ranges(const http_slice_t *value, off_t size, http_range_t *ranges,
+    int max)
 {
-    snprintf(sendbuff, BUFF_SIZE, AUTOINDEX_INTRO, endpoint);
-    struct dirent *direntry;
-    struct stat statbuf;
-    char filepath[PATH_MAX];
-    char tempbuff[256];
-
-    while ((direntry = readdir(dir)) != NULL) {
-        if (strcmp(direntry->d_name, ".") == 0) continue;
-        strlcat(sendbuff, "<tr>\n<td><a href=\"", BUFF_SIZE);
-        /* href */
-        strlcat(sendbuff, endpoint, BUFF_SIZE);
-        if (endpoint[strlen(endpoint) - 1] != '/')
-            strlcat(sendbuff, "/", BUFF_SIZE);
-        strlcat(sendbuff, direntry->d_name, BUFF_SIZE);
-        strlcat(sendbuff, "\">", BUFF_SIZE);
-
-        /* Name */
-        strlcat(sendbuff, direntry->d_name, BUFF_SIZE);
-        strlcat(sendbuff, "</a></td>\n<td>", BUFF_SIZE);
-
-        /* Size */
-        snprintf(filepath, PATH_MAX, "%s/%s", path, direntry->d_name);
-        if (cached_stat(filepath, &statbuf) < 0) {
-            console_log(LOG_DBG, filepath, "Error stating: ",
-                strerror(errno));
-            tempbuff[0] = '\0';
+    const char *p = value->ptr, *end = value->ptr + value->len;
+    if (value->len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+        return -1;
+    p += 6;
+
+    int n = 0, specs = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
+
+        off_t first = -1, last = -1;
+        if (*p >= '0' && *p <= '9') {
+            for (first = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (first > (INT64_MAX - 9) / 10) return -1;
+                first = first * 10 + (*p - '0');
+            }
+        }
+        if (p == end || *p != '-')
+            return -1;
+        p++;
+        if (p < end && *p >= '0' && *p <= '9') {
+            for (last = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (last > (INT64_MAX - 9) / 10) return -1;
+                last = last * 10 + (*p - '0');
+            }
+        }
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < end && *p != ',')
+            return -1;
+        specs++;
+
+        if (first < 0) {
+            /* Suffix, the last bytes */
+            if (last < 0)
+                return -1;
+            if (last == 0 || size == 0)
+                continue;
+            first = last < size ? size - last : 0;
+            last = size - 1;
+        } else {
+            if (last >= 0 && last < first)
+                return -1;
+            if (first >= size)
+                continue;
+            if (last < 0 || last >= size)
+                last = size - 1;
+        }
+
+        if (n == max)
+            return -1;
+        ranges[n].first = first;
+        ranges[n].last = last;
+        n++;
+    }
+    return specs > 0 ? n : -1;
+}
+
+/* Strong validator from what stat already has: inode, size and the
+   modification time to the nanosecond */
+void
+http_etag(const struct stat *st, char *buff, size_t size) {
+    snprintf(buff, size, "\"%lx-%llx-%llx\"", (unsigned long)st->st_ino,
+        (unsigned long long)st->st_size,
+        (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+        st->st_mtim.tv_nsec);
+}
+
+/* If-None-Match list against etag, weak comparison */
+int
+http_etag_match(const http_slice_t *list, const char *etag) {
+    size_t etaglen = strlen(etag);
+    const char *p = list->ptr, *end = list->ptr + list->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
+        if (*p == '*')
+            return 1;
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/')
+            p += 2;
+        const char *tag = p;
+        if (p < end && *p == '"') {
+            const char *close = memchr(p + 1, '"', end - p - 1);
+            p = close ? close + 1 : end;
         } else {
-            human_size(statbuf.st_size, tempbuff, PATH_MAX);
-            strlcat(sendbuff, tempbuff, BUFF_SIZE);
+            while (p < end && *p != ',')
+                p++;
         }
-        strlcat(sendbuff, "</td>\n<td>", BUFF_SIZE);
+        if ((size_t)(p - tag) == etaglen && memcmp(tag, etag, etaglen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether the client's copy is still good. If-None-Match wins over
+   If-Modified-Since */
+int
+http_not_modified(const http_request_t *req, const char *etag,
+    time_t mtime)
+{
+    const http_slice_t *inm = http_header(req, "If-None-Match");
+    if (inm)
+        return http_etag_match(inm, etag);
+
+    const http_slice_t *ims = http_header(req, "If-Modified-Since");
+    if (!ims || ims->len >= 64)
+        return 0;
+    char date[64];
+    memcpy(date, ims->ptr, ims->len);
+    date[ims->len] = '\0';
+    struct tm tm = { 0 };
+    if (!strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        return 0;
+    return mtime <= timegm(&tm);
+}
+
+/* If-Range holding the file's strong entity tag or its Last-Modified
+   date */
+int
+http_if_range(const http_request_t *req, const char *etag, time_t mtime) {
+    const http_slice_t *ifrange = http_header(req, "If-Range");
+    if (!ifrange)
+        return 1;
+    if (ifrange->len > 0 && ifrange->ptr[0] == '"') {
+        return ifrange->len == strlen(etag) &&
+            memcmp(ifrange->ptr, etag, ifrange->len) == 0;
+    }
+    char date[HTTP_DATE_LEN + 1];
+    http_date(mtime, date);
+    return ifrange->len == HTTP_DATE_LEN &&
+        memcmp(ifrange->ptr, date, HTTP_DATE_LEN) == 0;
+}
+
+/* Part of the file, from the descriptor or the mapping */
+int
+send_range(client_t *cs, CACHED_CONTENT *content, CACHED_FD *cfd,
+    off_t off, size_t len)
+{
+    if (cfd)
+        return cs_sendfile(cs, cfd, off, len);
+    return cs_send_content(cs, content, off, len);
+}
 
-        /* Type */
-        strlcat(sendbuff, get_mime_type(filepath), BUFF_SIZE);
-        strlcat(sendbuff, "</td>\n<td>", BUFF_SIZE);
-        
-        /* Date */
-        struct tm *lt = localtime(&statbuf.st_mtime);
-        strftime(tempbuff, PATH_MAX, "%Y-%b-%d %H:%M", lt);
-        strlcat(sendbuff, tempbuff, BUFF_SIZE);
-        strlcat(sendbuff, "</td>\n</tr>", BUFF_SIZE);
+/* Regular file, whole or the ranges asked for, or nothing at all when
+   the client has it already */
+void
+send_file(http_ctx_t *ctx, const location_node_t *location,
+    const http_request_t *req, const char *path, const struct stat *statbuf)
+{
+    client_t *cs = ctx->cs;
+    strbuf_t *log = &ctx->log;
+    strbuf_t *headers = &ctx->headers;
+
+    /* Validators come from the cached stat, revalidation never opens the
+       file */
+    char etag[64], lastmod[HTTP_DATE_LEN + 1];
+    http_etag(statbuf, etag, sizeof(etag));
+    http_date(statbuf->st_mtime, lastmod);
+    strbuf_printf(headers, "ETag: %s\r\nLast-Modified: %s\r\n", etag,
+        lastmod);
+    if (http_not_modified(req, etag, statbuf->st_mtime)) {
+        strbuf_cat(log, " 304 Not Modified");
+        sendhead(ctx, location, &status_304);
+        return;
     }
-    strlcat(sendbuff, AUTOINDEX_OUTRO, BUFF_SIZE);
 
-    if (cs_send(cs, sendbuff, strlen(sendbuff), 0) < 0) {
-        console_log(LOG_ERR, cs->addrstr, "Error sending: ",
+    /* Big files to plain sockets go by sendfile from a descriptor, and so
+       do those the content cache turns away. The rest from a mapping,
+       cached if admitted */
+    int cansendfile = !cs->ctx && !cs->uring && sendfile_threshold > 0;
+    int usesendfile = cansendfile && statbuf->st_size >= sendfile_threshold;
+    int cache = !usesendfile && cached_admit(path, statbuf->st_size);
+    if (!cache && cansendfile)
+        usesendfile = 1;
+    size_t size = 0;
+    CACHED_CONTENT *content = NULL;
+    CACHED_FD *cfd = NULL;
+    if (usesendfile) {
+        cfd = cached_fd_open(path);
+        if (cfd) size = cfd->st.st_size;
+    } else {
+        content = cached_open(path, cache);
+        if (content) size = content->size;
+    }
+    if (!content && !cfd) {
+        console_log(LOG_ERR, cs->addrstr, "Error fopening: ",
             strerror(errno));
+        send503(cs);
+        strbuf_cat(log, " 503 Service Unavailable");
+        return;
+    }
+
+    http_range_t ranges[RANGES_MAX];
+    int nranges = -1;
+    const http_slice_t *range = http_header(req, "Range");
+    if (range && http_if_range(req, etag, statbuf->st_mtime))
+        nranges = http_ranges(range, size, ranges, RANGES_MAX);
+
+    const char *type = location->mimeheader || nranges > 1 ?
+        cached_mime_type(path) : NULL;
+    strbuf_lit(headers, "Accept-Ranges: bytes\r\n");
+
+    int r = 0;
+    if (nranges == 0) {
+        strbuf_cat(log, " 416 Range Not Satisfiable");
+        strbuf_printf(headers, "Content-Range: bytes */%zu\r\n"
+            "Content-Length: 0\r\n", size);
+        sendhead(ctx, location, &status_416);
+    } else if (nranges == 1) {
+        strbuf_cat(log, " 206 Partial Content");
+        if (type) {
+            strbuf_lit(headers, "Content-Type: ");
+            strbuf_cat(headers, type);
+            strbuf_lit(headers, "\r\n");
+        }
+        size_t len = ranges[0].last - ranges[0].first + 1;
+        strbuf_printf(headers, "Content-Range: bytes %lld-%lld/%zu\r\n"
+            "Content-Length: %zu\r\n", (long long)ranges[0].first,
+            (long long)ranges[0].last, size, len);
+        sendhead(ctx, location, &status_206);
+        r = send_range(cs, content, cfd, ranges[0].first, len);
+    } else if (nranges > 1) {
+        /* Every part's head is known up front, so is the length */
+        static __thread unsigned long parts = 0;
+        char boundary[40];
+        snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+            (unsigned long)time(NULL), ++parts);
+
+        strbuf_t part;
+        char *partbuff = arena_alloc(ctx->arena, 1024);
+        if (!partbuff) {
+            send503(cs);
+            strbuf_cat(log, " 503 Service Unavailable");
+            goto done;
+        }
+        size_t total = 0;
+        for (int i = 0; i < nranges; i++) {
+            strbuf_init(&part, partbuff, 1024);
+            strbuf_printf(&part, "\r\n--%s\r\nContent-Type: %s\r\n"
+                "Content-Range: bytes %lld-%lld/%zu\r\n\r\n", boundary, type,
+                (long long)ranges[i].first, (long long)ranges[i].last, size);
+            total += part.len + ranges[i].last - ranges[i].first + 1;
+        }
+        strbuf_init(&part, partbuff, 1024);
+        strbuf_printf(&part, "\r\n--%s--\r\n", boundary);
+        total += part.len;
+
+        strbuf_cat(log, " 206 Partial Content");
+        strbuf_printf(headers, "Content-Type: multipart/byteranges; "
+            "boundary=%s\r\nContent-Length: %zu\r\n", boundary, total);
+        sendhead(ctx, location, &status_206);
+        for (int i = 0; i < nranges && r >= 0; i++) {
+            strbuf_init(&part, partbuff, 1024);
+            strbuf_printf(&part, "\r\n--%s\r\nContent-Type: %s\r\n"
+                "Content-Range: bytes %lld-%lld/%zu\r\n\r\n", boundary, type,
+                (long long)ranges[i].first, (long long)ranges[i].last, size);
+            r = cs_send(cs, part.buff, part.len);
+            if (r >= 0)
+                r = send_range(cs, content, cfd, ranges[i].first,
+                    ranges[i].last - ranges[i].first + 1);
+        }
+        if (r >= 0) {
+            strbuf_init(&part, partbuff, 1024);
+            strbuf_printf(&part, "\r\n--%s--\r\n", boundary);
+            r = cs_send(cs, part.buff, part.len);
+        }
+    } else {
+        strbuf_cat(log, " 200 OK");
+        if (type) {
+            strbuf_lit(headers, "Content-Type: ");
+            strbuf_cat(headers, type);
+            strbuf_lit(headers, "\r\n");
+        }
+        strbuf_printf(headers, "Content-Length: %zu\r\n", size);
+        sendhead(ctx, location, &status_200);
+        r = send_range(cs, content, cfd, 0, size);
+    }
+
+    if (r < 0) {
+        console_log(LOG_ERR, cs->addrstr, "Error sending: ", strerror(errno));
+        cs->keepalive = 0;
+    }
+
+    done:
+    if (cfd)
+        cached_fd_close(cfd);
+    if (content)
+        cached_content_release(content);
+}
+
+/* Queue a piece of a chunked body, or the body as is */
+int
+send_chunk(client_t *cs, int chunked, const char *buf, size_t n) {
+    if (n == 0)
+        return 0;
+    if (chunked) {
+        char size[24];
+        int len = snprintf(size, sizeof(size), "%zx\r\n", n);
+        if (cs_send(cs, size, len) < 0 || cs_send(cs, buf, n) < 0 ||
+            cs_send(cs, "\r\n", 2) < 0)
+            return -1;
+        return n;
+    }
+    return cs_send(cs, buf, n);
+}
+
+/* Value of name in a query string, NULL if absent */
+const char *
+query_param(const char *query, size_t qlen, const char *name, size_t *len) {
+    size_t namelen = strlen(name);
+    const char *end = query + qlen;
+    while (query < end) {
+        const char *amp = memchr(query, '&', end - query);
+        if (!amp) amp = end;
+        if ((size_t)(amp - query) > namelen && query[namelen] == '=' &&
+            strncmp(query, name, namelen) == 0)
+        {
+            *len = amp - query - namelen - 1;
+            return query + namelen + 1;
+        }
+        query = amp + 1;
+    }
+    return NULL;
+}
+
+/* Listing of the directory, one page of it when autoindex_page is set.
+   HTTP/1.1 gets it chunked, older clients until the connection closes */
+void
+send_autoindex(http_ctx_t *ctx, const location_node_t *location,
+    const http_request_t *req, autoindex_t *ai, const char *endpoint,
+    const char *query, size_t qlen)
+{
+    client_t *cs = ctx->cs;
+    int chunked = req->minor >= 1;
+    if (!chunked)
+        cs->keepalive = 0;
+
+    autoindex_sort_t sort = AUTOINDEX_SORT_NAME;
+    int desc = 0;
+    size_t page = 1, len;
+    const char *value;
+    if ((value = query_param(query, qlen, "sort", &len)))
+        sort = autoindex_sort(value, len);
+    if ((value = query_param(query, qlen, "order", &len)))
+        desc = len == 4 && strncmp(value, "desc", 4) == 0;
+    if ((value = query_param(query, qlen, "page", &len)))
+        page = strtoul(value, NULL, 10);
+
+    size_t perpage = autoindex_page > 0 ? (size_t)autoindex_page : ai->count;
+    size_t pages = perpage > 0 ? (ai->count + perpage - 1) / perpage : 0;
+    if (pages == 0) pages = 1;
+    if (page < 1) page = 1;
+    if (page > pages) page = pages;
+
+    const char *rows = NULL;
+    ssize_t rowslen = autoindex_rows(ai, sort, desc, (page - 1) * perpage,
+        perpage, &rows);
+    char *headbuff = arena_alloc(ctx->arena, AUTOINDEX_HEAD_SIZE);
+    if (rowslen < 0 || !headbuff) {
+        console_log(LOG_ERR, cs->addrstr, "Error listing: ",
+            "out of memory");
+        send503(cs);
+        strbuf_lit(&ctx->log, " 503 Service Unavailable");
+        return;
+    }
+
+    strbuf_lit(&ctx->log, " 200 OK");
+    if (location->mimeheader)
+        strbuf_lit(&ctx->headers, "Content-Type: text/html\r\n");
+    if (chunked)
+        strbuf_lit(&ctx->headers, "Transfer-Encoding: chunked\r\n");
+    sendhead(ctx, location, &status_200);
+
+    strbuf_t sb;
+    strbuf_init(&sb, headbuff, AUTOINDEX_HEAD_SIZE);
+    autoindex_head(&sb, endpoint, sort, desc);
+    int r = send_chunk(cs, chunked, sb.buff, sb.len);
+    if (r >= 0)
+        r = send_chunk(cs, chunked, rows, rowslen);
+    strbuf_init(&sb, headbuff, AUTOINDEX_HEAD_SIZE);
+    autoindex_tail(&sb, sort, desc, page, pages);
+    if (r >= 0)
+        r = send_chunk(cs, chunked, sb.buff, sb.len);
+    if (r >= 0 && chunked)
+        r = cs_send(cs, "0\r\n\r\n", 5);
+    if (r < 0) {
+        console_log(LOG_ERR, cs->addrstr, "Error sending: ", strerror(errno));
+        cs->keepalive = 0;
     }
 }
 
 
 location_node_t *
-location_find(location_node_t **head, const char *endpoint) {
+location_find(location_node_t **head, const char *endpoint, size_t len) {
     if (!head) return NULL;
     location_node_t *location_current = location_list, *location_best = NULL;
-    int bestn = 0;
+    size_t bestn = 0;
     while (location_current) {
-        int i = 0, n = 0;
-        while (endpoint[i] && location_current->location[i]) {
+        size_t i = 0, n = 0;
+        while (i < len && location_current->location[i]) {
             if (endpoint[i] == location_current->location[i]) n++;
             i++;
         }
@@ -333,88 +1129,186 @@ config_find_autoindex(config_node_t *head) {
     return 0;
 }
 
+http_ctx_t *
+http_ctx_new(client_t *cs) {
+    arena_t *arena = arena_thread();
+    if (!arena) return NULL;
+    http_ctx_t *ctx = arena_alloc(arena, sizeof(http_ctx_t));
+    if (!ctx) return NULL;
+    ctx->cs = cs;
+    ctx->arena = arena;
+    char *headers = arena_alloc(arena, BUFF_SIZE);
+    char *log = arena_alloc(arena, LOG_LINE_SIZE);
+    if (!headers || !log) {
+        arena_reset(arena);
+        return NULL;
+    }
+    strbuf_init(&ctx->headers, headers, BUFF_SIZE);
+    strbuf_init(&ctx->log, log, LOG_LINE_SIZE);
+    return ctx;
+}
+
+void
+http_date_render(int slot) {
+    char *header = date_headers[slot];
+    memcpy(header, "Date: ", 6);
+    http_date(time(NULL), header + 6);
+    memcpy(header + 6 + HTTP_DATE_LEN, "\r\n", 3);
+}
+
+void *
+http_clock_loop(void *ptr) {
+    (void)ptr;
+    while (1) {
+        /* Tick right after the second changes */
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec = 0;
+        ts.tv_nsec = 1000000000L - ts.tv_nsec;
+        nanosleep(&ts, NULL);
+
+        int next = !__atomic_load_n(&date_current, __ATOMIC_RELAXED);
+        http_date_render(next);
+        __atomic_store_n(&date_current, next, __ATOMIC_RELEASE);
+    }
+}
+
+/* Exports */
 int
-config_find_mimeheader(config_node_t *head) {
-    while (head) {
-        if (head->type == CONFIG_MIMEHEADER)
-            return 1;
-        head = head->next;
+http_clock_start(void) {
+    http_date_render(0);
+    pthread_t clock_thread;
+    if (pthread_create(&clock_thread, NULL, http_clock_loop, NULL) != 0) {
+        printf("Error starting clock thread: %s\n", strerror(errno));
+        return -1;
     }
+    pthread_detach(clock_thread);
     return 0;
 }
 
+/* Turn a client away without reading its request */
 void
-http_process(const client_t *cs, const char *buff, size_t len) {
-    const char *endpoint_ptr = find_field(buff);
-    if (!endpoint_ptr) {
-        console_log(LOG_ERR, cs->addrstr, "Missing endpoint", NULL);
+http_reject(client_t *cs) {
+    /* A 503 over TLS would first need the handshake, which is the very
+       work being shed. Just close */
+    if (cs->ctx) {
+        console_log(LOG_WARN, cs->addrstr, "Overloaded, TLS client dropped",
+            NULL);
         return;
     }
 
-    const char *http_version = find_field(endpoint_ptr);
-    if (!http_version) {
-        console_log(LOG_ERR, cs->addrstr, "Missing version", NULL);
-        return;
-    }
+    /* Don't let a stalled client hold up the caller */
+    struct timeval tv = { 1, 0 };
+    setsockopt(cs->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(cs->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    strncpy(endpoint, endpoint_ptr, http_version - endpoint_ptr - 1);
-    endpoint[http_version - endpoint_ptr - 1] = '\0';
+    cs->keepalive = 0;
+    send503(cs);
+    cs_flush(cs);
+    console_log(LOG_WARN, cs->addrstr, "Overloaded, 503 Service Unavailable",
+        NULL);
+}
 
-    strncpy(logbuff, buff, http_version - buff - 1);
-    logbuff[http_version - buff - 1] = '\0';
+/* The head outgrew the receive buffer, answer before closing */
+void
+http_too_large(client_t *cs) {
+    console_log(LOG_ERR, cs->addrstr, "Request too large", NULL);
+    cs->keepalive = 0;
+    send431(cs);
+    cs_flush(cs);
+}
+
+/* Returns 1 if the connection stays open for another request */
+int
+http_process(client_t *cs, const http_request_t *req) {
+    const http_slice_t *target = &req->target;
+    if (target->len >= 1024) {
+        console_log(LOG_ERR, cs->addrstr, "Endpoint too long", NULL);
+        cs->keepalive = 0;
+        send414(cs);
+        return 0;
+    }
+
+    http_ctx_t *ctx = http_ctx_new(cs);
+    if (!ctx) {
+        console_log(LOG_ERR, cs->addrstr, "Out of request memory", NULL);
+        cs->keepalive = 0;
+        send503(cs);
+        return 0;
+    }
+    strbuf_t *log = &ctx->log;
+    strbuf_printf(log, "%.*s %.*s", (int)req->method.len,
+        req->method.ptr, (int)target->len, target->ptr);
+
+    /* Keep-alive is the default since HTTP/1.1, opt-in before */
+    const http_slice_t *connection = http_header(req, "Connection");
+    int keepalive = req->minor >= 1 ?
+        !(connection && slice_has_token(connection, "close")) :
+        (connection && slice_has_token(connection, "keep-alive"));
+
+    cs->requests++;
+    cs->keepalive = keepalive && keepalive_timeout > 0 &&
+        (keepalive_requests == 0 || cs->requests < keepalive_requests) &&
+        /* Workers go to queued connections before idle ones */
+        !(cs->pooled && pool_waiting());
+
+    /* The query is not part of the path */
+    const char *query = memchr(target->ptr, '?', target->len);
+    size_t pathlen = query ? (size_t)(query - target->ptr) : target->len;
+    size_t qlen = query ? target->len - pathlen - 1 : 0;
+    if (query) query++;
 
     /* Handle methods */
-    if (strncmp(buff, "GET", 3) == 0) {
-        location_node_t *location = location_find(&location_list, endpoint);
+    if (slice_eq(&req->method, "GET")) {
+        location_node_t *location = location_find(&location_list,
+            target->ptr, pathlen);
         if (!location) {
-            strlcat(logbuff, " -> 404 Not Found (no location)", 1024);
+            strbuf_cat(log, " -> 404 Not Found (no location)");
             send404(cs);
-            goto doclose;
+            goto done;
         }
 
         const char *webroot = config_find_root(location->config);
         if (!webroot) {
-            strlcat(logbuff, " -> 503 Service Unavailable (no webroot)", 1024);
+            strbuf_cat(log, " -> 503 Service Unavailable (no webroot)");
             send503(cs);
-            goto doclose;
+            goto done;
         }
 
         char path[PATH_MAX];
-        snprintf(path, PATH_MAX, "%s%s", webroot, endpoint);
-
-        strlcat(logbuff, " -> ", 1024);
-        strlcat(logbuff, path, 1024);
-
-        /* Make headers */
-        char headers[65535]; headers[0] = '\0';
-        config_node_t *config_current = location->config;
-        while (config_current) {
-            if (config_current->type == CONFIG_HEADER) {
-                strlcat(headers, config_current->param1, 65535);
-                strlcat(headers, ": ", 65535);
-                strlcat(headers, config_current->param2, 65535);
-                strlcat(headers, "\n", 65535);
-            }
-            config_current = config_current->next;
+        int rootlen = snprintf(path, PATH_MAX, "%s", webroot);
+        /* Terminated, decoded copy of the endpoint, for free */
+        if (rootlen >= PATH_MAX || url_decode(path + rootlen,
+            PATH_MAX - rootlen, target->ptr, pathlen) < 0)
+        {
+            strbuf_cat(log, " -> 400 Bad Request (bad escape)");
+            cs->keepalive = 0;
+            send400(cs);
+            goto done;
         }
-        int mimeenabled = config_find_mimeheader(location->config);
+        const char *endpoint = path + rootlen;
+
+        strbuf_cat(log, " -> ");
+        strbuf_cat(log, path);
+
 
         /* Checkout file */
         struct stat statbuf;
-        if (cached_stat(path, &statbuf) < 0) {
+        char realp[PATH_MAX]; /* the cache's key for it */
+        if (cached_stat(path, &statbuf, realp) < 0) {
             if (errno == EACCES) {
                 send403(cs);
-                strlcat(logbuff, " 403 Forbidden", 1024);
+                strbuf_cat(log, " 403 Forbidden");
             } else if (errno == ENOENT) {
                 send404(cs);
-                strlcat(logbuff, " 404 Not Found", 1024);
+                strbuf_cat(log, " 404 Not Found");
             } else {
                 send503(cs);
-                strlcat(logbuff, " 503 Service Unavailable", 1024);
+                strbuf_cat(log, " 503 Service Unavailable");
             }
             console_log(LOG_DBG, cs->addrstr, "Error stating: ",
                 strerror(errno));
-            goto doclose;
+            goto done;
         }
         /* It exists and its readable */
 
@@ -427,65 +1321,107 @@ http_process(const client_t *cs, const char *buff, size_t len) {
             snprintf(temppath, PATH_MAX, "%s%s", path, index);
             if (index) { /* If default index defined */
                 /* Check it out */
-                if (cached_stat(temppath, &statbuf) < 0) {
+                if (cached_stat(temppath, &statbuf, realp) < 0) {
                     console_log(LOG_DBG, cs->addrstr, "Error stating: ",
                         strerror(errno));
                     sendisfile = 0;
+                } else {
+                    /* It exists and its readable */
+                    strbuf_cat(log, index);
+                    sendisfile = 1;
                 }
-                /* It exists and its readable */
-                strlcat(path, index, PATH_MAX);
-                strlcat(logbuff, index, 1024);
-                sendisfile = 1;
             } else sendisfile = 0;
         }
 
         if (sendisfile) {
-            /* Open file */
-            size_t size = 0;
-            const char *ptr = cached_open(path, &size);
-            if (ptr) {
-                strlcat(logbuff, " 200 OK", 1024);
-                if (mimeenabled) {
-                    strlcat(headers, "Content-Type: ", 65535);
-                    strlcat(headers, get_mime_type(path), 65535);
-                    strlcat(headers, "\n", 65535);
-                }
-                send200(cs, headers);
-                cs_send(cs, ptr, size, 0);
-            } else {
-                console_log(LOG_ERR, cs->addrstr, "Error fopening: ",
-                    strerror(errno));
-                send503(cs);
-                strlcat(logbuff, " 503 Service Unavailable", 1024);
-            }
+            send_file(ctx, location, req, realp, &statbuf);
         } else if (config_find_autoindex(location->config)) {
             /* If dir and autoindex enabled */
-            DIR *dir = opendir(path);
-            if (dir) {
-                strlcat(logbuff, " 200 OK", 1024);
-                if (mimeenabled)
-                    strlcat(headers, "Content-Type: text/html\n", 65535);
-                send200(cs, headers);
-                sendautoindex(cs, dir, path, endpoint);
-                closedir(dir);
+            autoindex_t *ai = cached_autoindex(realp);
+            if (ai) {
+                send_autoindex(ctx, location, req, ai, endpoint, query, qlen);
+                autoindex_unref(ai);
             } else {
                 console_log(LOG_ERR, cs->addrstr, "Error opendiring: ",
                     strerror(errno));
                 send503(cs);
-                strlcat(logbuff, " 503 Service Unavailable", 1024);
+                strbuf_cat(log, " 503 Service Unavailable");
             }
         } else {
-            strlcat(logbuff, " 403 Forbidden", 1024);
+            strbuf_cat(log, " 403 Forbidden");
             send403(cs);
         }
 
     } else {
-        strlcat(logbuff, " 501 Not Implemented", 1024);
+        /* Can't tell where an unknown request's body ends */
+        cs->keepalive = 0;
+        strbuf_cat(log, " 501 Not Implemented");
         send501(cs);
     }
 
-    doclose:
-    cs_close(cs);
+    done:
+    console_log(LOG_INFO, cs->addrstr, log->buff, NULL);
+    /* Anything still needed was copied into cs->out */
+    arena_reset(ctx->arena);
+
+    return cs->keepalive;
+}
+
+/* Process every complete request at the start of buff. Returns the bytes
+   consumed, or -1 when the connection has to be closed */
+ssize_t
+http_process_buffer(client_t *cs, const char *buff, size_t len) {
+    size_t used = 0;
+    while (used < len) {
+        /* Bodies are not used, only stepped over */
+        if (cs->discard > 0) {
+            size_t n = len - used < cs->discard ? len - used : cs->discard;
+            cs->discard -= n;
+            used += n;
+            continue;
+        }
+        ssize_t reqlen = http_parse(&cs->req, buff + used, len - used);
+        if (reqlen < 0) {
+            console_log(LOG_ERR, cs->addrstr, "Malformed request", NULL);
+            cs->keepalive = 0;
+            send400(cs);
+            cs_flush(cs);
+            return -1;
+        }
+        if (reqlen == 0) {
+            if (len - used >= BUFF_SIZE - 1) {
+                http_too_large(cs);
+                return -1;
+            }
+            break;
+        }
+
+        if (cs->req.transfer_encoding) {
+            /* Chunked bodies are not supported, and guessing where one
+               ends is how requests get smuggled */
+            console_log(LOG_ERR, cs->addrstr, "Transfer-Encoding refused",
+                NULL);
+            cs->keepalive = 0;
+            send501(cs);
+            cs_flush(cs);
+            return -1;
+        }
+
+        int keepalive = http_process(cs, &cs->req);
+        cs->discard = cs->req.content_length > 0 ? cs->req.content_length : 0;
+        http_parser_init(&cs->req);
+        if (!keepalive) {
+            cs_flush(cs);
+            return -1;
+        }
+        used += reqlen;
+        /* The socket is full, the rest waits for it to drain */
+        if (cs->pending)
+            break;
+    }
 
-    console_log(LOG_INFO, cs->addrstr, logbuff, NULL);
+    /* Responses to pipelined requests go out together */
+    if (cs_flush(cs) < 0)
+        return -1;
+    return used;
 }
@@ -21,15 +21,68 @@
 #ifndef _HTTP_H
 #define _HTTP_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include <tls.h>
 
+#include "http_parser.h"
+
+#define OUT_BUFF_SIZE   16384
+#define OUT_IOV_MAX     64
+
 /* Structs */
+struct uring_conn_s;
+struct cached_content_s;
+struct cached_fd_s;
+
+/* Responses gathered for one batched write */
+typedef struct {
+    struct iovec iov[OUT_IOV_MAX];
+    int iovcnt;
+    size_t len;                 /* used in buff by copied data */
+    char buff[OUT_BUFF_SIZE];
+    struct cached_content_s *held[OUT_IOV_MAX]; /* released once written */
+    int nheld;
+} http_out_t;
+
+/* Output of an event loop connection the socket would not take yet, kept
+   in order until it does */
+typedef struct http_pending_s {
+    struct http_pending_s *next;
+    const char *ptr;                    /* unsent bytes */
+    size_t len;
+    struct cached_content_s *content;   /* held mapping ptr points into */
+    struct cached_fd_s *cfd;            /* or held file to sendfile from */
+    off_t off;
+    char data[];                        /* copied bytes ptr points into */
+} http_pending_t;
+
 typedef struct {
     int fd;
     struct tls *ctx;
     char *addrstr;
+    struct uring_conn_s *uring; /* io_uring backend, NULL for plain I/O */
+    int requests;               /* served on this connection */
+    int keepalive;              /* current response keeps it open */
+    int pooled;                 /* holds a pool worker while kept open */
+    http_request_t req;         /* request being received */
+    size_t discard;             /* body bytes still to be skipped */
+    http_out_t out;
+    int nonblock;               /* event loops, never wait for the socket */
+    http_pending_t *pending;    /* nonblock only, written by cs_drain */
+    http_pending_t *pending_tail;
 } client_t;
 
-void http_process(const client_t *cs, const char *buff, size_t len);
+void cs_init(client_t *cs, int fd, struct tls *ctx, char *addrstr);
+int cs_flush(client_t *cs);
+int cs_drain(client_t *cs);
+int cs_close(client_t *cs);
+
+int http_clock_start(void);
+void http_reject(client_t *cs);
+void http_too_large(client_t *cs);
+int http_process(client_t *cs, const http_request_t *req);
+ssize_t http_process_buffer(client_t *cs, const char *buff, size_t len);
 
 #endif
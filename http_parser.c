@@ -0,0 +1,201 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    http_parser.c: Incremental HTTP request parser
+
+*/
+
+#include <string.h>
+#include <strings.h>
+
+#include "http_parser.h"
+
+
+void
+http_parser_init(http_request_t *req) {
+    req->state = HTTP_PARSE_LINE;
+    req->base = NULL;
+    req->line = 0;
+    req->scan = 0;
+    req->nheaders = 0;
+    req->content_length = -1;
+    req->transfer_encoding = 0;
+}
+
+/* The caller moved the unconsumed bytes, follow them */
+void
+http_parser_rebase(http_request_t *req, const char *buff) {
+    if (req->base && req->state == HTTP_PARSE_HEADERS) {
+        req->method.ptr = buff + (req->method.ptr - req->base);
+        req->target.ptr = buff + (req->target.ptr - req->base);
+        req->version.ptr = buff + (req->version.ptr - req->base);
+        for (int i = 0; i < req->nheaders; i++) {
+            http_header_t *h = &req->headers[i];
+            h->name.ptr = buff + (h->name.ptr - req->base);
+            h->value.ptr = buff + (h->value.ptr - req->base);
+        }
+    }
+    req->base = buff;
+}
+
+/* METHOD SP target SP HTTP/1.x */
+int
+parse_request_line(http_request_t *req, const char *line, const char *end) {
+    const char *sp = memchr(line, ' ', end - line);
+    if (!sp || sp == line) return -1;
+    req->method.ptr = line;
+    req->method.len = sp - line;
+
+    line = sp + 1;
+    sp = memchr(line, ' ', end - line);
+    if (!sp || sp == line) return -1;
+    req->target.ptr = line;
+    req->target.len = sp - line;
+
+    line = sp + 1;
+    if (end - line != 8 || strncmp(line, "HTTP/1.", 7) != 0 ||
+        line[7] < '0' || line[7] > '9')
+        return -1;
+    req->version.ptr = line;
+    req->version.len = 8;
+    req->minor = line[7] - '0';
+    return 0;
+}
+
+/* name: OWS value OWS */
+int
+parse_header(http_request_t *req, const char *line, const char *end) {
+    /* No obsolete line folding */
+    if (*line == ' ' || *line == '\t') return -1;
+    const char *colon = memchr(line, ':', end - line);
+    if (!colon || colon == line) return -1;
+    if (colon[-1] == ' ' || colon[-1] == '\t') return -1;
+    if (req->nheaders == HTTP_HEADERS_MAX) return -1;
+
+    const char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+
+    http_header_t *h = &req->headers[req->nheaders++];
+    h->name.ptr = line;
+    h->name.len = colon - line;
+    h->value.ptr = value;
+    h->value.len = end - value;
+
+    /* Framing headers are picked up here, a body read any other way than
+       the client meant would be taken for the next request */
+    if (slice_case_eq(&h->name, "Content-Length")) {
+        /* One plain number, repeated or listed lengths are refused */
+        if (req->content_length >= 0 || h->value.len == 0 ||
+            h->value.len > 18)
+            return -1;
+        ssize_t n = 0;
+        for (size_t i = 0; i < h->value.len; i++) {
+            char c = h->value.ptr[i];
+            if (c < '0' || c > '9') return -1;
+            n = n * 10 + (c - '0');
+        }
+        req->content_length = n;
+    } else if (slice_case_eq(&h->name, "Transfer-Encoding")) {
+        req->transfer_encoding = 1;
+    }
+    return 0;
+}
+
+/* Feed the bytes of a request received so far, buff starting where the
+   request starts. Picks up where the last call left off. Returns the length
+   of the request head once it is complete, 0 if more is needed or -1 if it
+   is malformed */
+ssize_t
+http_parse(http_request_t *req, const char *buff, size_t len) {
+    if (req->base != buff)
+        http_parser_rebase(req, buff);
+
+    const char *end = buff + len;
+    const char *line = buff + req->line;
+    const char *scan = buff + req->scan;
+    const char *nl;
+
+    while ((nl = memchr(scan, '\n', end - scan)) != NULL) {
+        const char *line_end = nl;
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+
+        if (req->state == HTTP_PARSE_LINE) {
+            /* Stray empty lines before a request are ignored */
+            if (line_end != line) {
+                if (parse_request_line(req, line, line_end) < 0)
+                    return -1;
+                req->state = HTTP_PARSE_HEADERS;
+            }
+        } else if (line_end == line) {
+            /* Empty line ends the head */
+            return nl + 1 - buff;
+        } else if (parse_header(req, line, line_end) < 0) {
+            return -1;
+        }
+
+        line = scan = nl + 1;
+    }
+
+    req->line = line - buff;
+    req->scan = len;
+    return 0;
+}
+
+/* First header called name, NULL if absent */
+const http_slice_t *
+http_header(const http_request_t *req, const char *name) {
+    size_t namelen = strlen(name);
+    for (int i = 0; i < req->nheaders; i++) {
+        const http_header_t *h = &req->headers[i];
+        if (h->name.len == namelen &&
+            strncasecmp(h->name.ptr, name, namelen) == 0)
+            return &h->value;
+    }
+    return NULL;
+}
+
+int
+slice_eq(const http_slice_t *s, const char *str) {
+    size_t n = strlen(str);
+    return s->len == n && memcmp(s->ptr, str, n) == 0;
+}
+
+int
+slice_case_eq(const http_slice_t *s, const char *str) {
+    size_t n = strlen(str);
+    return s->len == n && strncasecmp(s->ptr, str, n) == 0;
+}
+
+/* Comma separated value contains token */
+int
+slice_has_token(const http_slice_t *s, const char *token) {
+    size_t toklen = strlen(token);
+    const char *value = s->ptr, *end = s->ptr + s->len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == ',')) value++;
+        const char *tok_end = memchr(value, ',', end - value);
+        if (!tok_end) tok_end = end;
+        size_t n = tok_end - value;
+        while (n > 0 && value[n - 1] == ' ') n--;
+        if (n == toklen && strncasecmp(value, token, toklen) == 0)
+            return 1;
+        value = tok_end;
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _HTTP_PARSER_H
+#define _HTTP_PARSER_H
+
+#include <sys/types.h>
+
+#define HTTP_HEADERS_MAX    64
+
+/* Structs */
+/* Slice of the receive buffer, not terminated */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} http_slice_t;
+
+typedef struct {
+    http_slice_t name;
+    http_slice_t value;
+} http_header_t;
+
+typedef enum {
+    HTTP_PARSE_LINE,
+    HTTP_PARSE_HEADERS
+} http_parse_state_t;
+
+typedef struct {
+    http_parse_state_t state;
+    const char *base;   /* request start the slices point into */
+    size_t line;        /* start of the current line, from base */
+    size_t scan;        /* searched for a line end up to here */
+
+    http_slice_t method;
+    http_slice_t target;
+    http_slice_t version;
+    int minor;          /* HTTP/1.x */
+    http_header_t headers[HTTP_HEADERS_MAX];
+    int nheaders;
+    ssize_t content_length;     /* -1 if absent */
+    int transfer_encoding;      /* present, whatever the coding */
+} http_request_t;
+
+void http_parser_init(http_request_t *req);
+ssize_t http_parse(http_request_t *req, const char *buff, size_t len);
+
+const http_slice_t *http_header(const http_request_t *req, const char *name);
+int slice_eq(const http_slice_t *s, const char *str);
+int slice_case_eq(const http_slice_t *s, const char *str);
+int slice_has_token(const http_slice_t *s, const char *token);
+
+#endif
@@ -30,21 +30,22 @@
 
 #define LOG_BUFFER_SIZE 1024
 
-static char logbuff[LOG_BUFFER_SIZE];
-struct timeval tv;
-struct tm *tm_local;
-
 void console_log(int severity, const char *client, const char *msg,
     const char *str)
 {
+    /* Called from every connection thread at once, nothing shared */
+    char logbuff[LOG_BUFFER_SIZE];
+    struct timeval tv;
+    struct tm tm_local;
+
     logbuff[0] = '[';
 
     gettimeofday(&tv, NULL);
-    tm_local = localtime(&tv.tv_sec);
-    float sec = (float)tm_local->tm_sec + ((float)tv.tv_usec / 1000000.0f);
+    localtime_r(&tv.tv_sec, &tm_local);
+    float sec = (float)tm_local.tm_sec + ((float)tv.tv_usec / 1000000.0f);
 
     int aftertime = strftime(logbuff + 1, LOG_BUFFER_SIZE - 1,
-        "%d/%m/%Y:%H:%M:", tm_local);
+        "%d/%m/%Y:%H:%M:", &tm_local);
     snprintf(logbuff + 1 + aftertime, LOG_BUFFER_SIZE - 1 - aftertime, 
         "%06.5f] ", sec);
 
@@ -24,13 +24,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <pthread.h>
 
 #include "config.h"
 #include "socket.h"
 #include "tls_socket.h"
+#include "event.h"
+#include "uring.h"
+#include "pool.h"
+#include "slab.h"
 #include "cache.h"
+#include "mime.h"
+#include "http.h"
 #include "log.h"
 
 /* Text file (no '\0's) */
@@ -47,6 +54,16 @@ file_read(const char *path, char **buff) {
     return s;
 }
 
+int
+thread_list_join(fd_thread_node_t *head) {
+    while (head) {
+        /* listeners served by event loops have no thread of their own */
+        if (head->thread && pthread_join(head->thread, NULL) != 0)
+            return -1;
+        head = head->next;
+    }
+    return 0;
+}
 
 
 int
@@ -62,15 +79,17 @@ main(int argc, char **argv) {
     config_parse(config);
 
     /* Print config */
-    string_node_t *listen_current = listen_list;
+    listen_node_t *listen_current = listen_list;
     while (listen_current) {
-        printf("listen %s\n", listen_current->str);
+        printf("listen %s %d\n", listen_current->str,
+            listen_current->workers);
         listen_current = listen_current->next;
     }
 
     listen_current = tls_listen_list;
     while (listen_current) {
-        printf("listen %s tls\n", listen_current->str);
+        printf("listen %s tls %d\n", listen_current->str,
+            listen_current->workers);
         listen_current = listen_current->next;
     }
 
@@ -80,6 +99,20 @@ main(int argc, char **argv) {
     if (cert_key_file)
         printf("certificate_key %s\n", cert_key_file);
 
+    printf("server_mode %s\n", server_mode_strs[server_mode]);
+    printf("keepalive_timeout %d\n", keepalive_timeout);
+    printf("keepalive_requests %d\n", keepalive_requests);
+    printf("worker_threads %d\n", worker_threads);
+    printf("worker_queue %d\n", worker_queue);
+    printf("worker_queue_delay %d\n", worker_queue_delay);
+    printf("slab_report_interval %d\n", slab_report_interval);
+    printf("sendfile_threshold %d\n", sendfile_threshold);
+    printf("open_file_cache %d\n", open_file_cache);
+    printf("content_cache_size %zu\n", content_cache_size);
+    printf("content_cache_entries %d\n", content_cache_entries);
+    printf("tls_session_lifetime %d\n", tls_session_lifetime);
+    printf("autoindex_page %d\n", autoindex_page);
+
     location_node_t *location_current = location_list;
     while (location_current) {
         printf("location %s\n", location_current->location);
@@ -100,40 +133,71 @@ main(int argc, char **argv) {
         exit(1);
     }
 
+    /* Unknown extensions still resolve, as octet-stream */
+    mime_init();
+
+    /* Date header, shared by all workers */
+    if (http_clock_start() < 0) {
+        exit(1);
+    }
+
+    /* Peers closing mid-send must not kill the process */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Worker pool for threaded listeners, TLS ones always are */
+    if (worker_threads > 0 && pool_start(worker_threads, worker_queue) < 0) {
+        exit(1);
+    }
+
+    if (slab_report_interval > 0 && slab_report_start(slab_report_interval) < 0) {
+        exit(1);
+    }
+
+    if (slab_report_interval > 0 && cache_report_start(slab_report_interval) < 0) {
+        exit(1);
+    }
+
+    /* Start event loops before listeners are attached to them */
+    if (server_mode == SERVER_EPOLL && event_loops_start(event_loops) < 0) {
+        exit(1);
+    }
+
+    /* io_uring rings are set up before listeners arm accepts on them */
+    if (server_mode == SERVER_URING && uring_loops_init(event_loops) < 0) {
+        console_log(LOG_WARN, "\t", "io_uring unavailable, ",
+            "falling back to thread mode");
+        server_mode = SERVER_THREAD;
+    }
+
     /* Start accept threads */
     server_start(listen_list);
     tls_server_start(tls_listen_list, cert_file, cert_key_file);
 
+    if (server_mode == SERVER_URING)
+        uring_loops_start();
+
     console_log(LOG_INFO, "\t", "Server started", NULL);
 
     /* Join accept threads (wait for them to exit) */
-    if (!listen_socket_list) {
+    if (!listen_socket_list && !tls_listen_socket_list) {
         console_log(LOG_ERR, "\t", "Nothing to accept", NULL);
         exit(1);
     }
-    fd_thread_node_t *listen_socket_current = listen_socket_list;
-    while (listen_socket_current) {
-        if (pthread_join(listen_socket_current->thread, NULL) != 0) {
-            console_log(LOG_ERR, "\t", "Error joining accept thread", NULL);
-            exit(1);
-        }
-        listen_socket_current = listen_socket_current->next;
+    if (thread_list_join(event_loop_list) < 0 ||
+        thread_list_join(uring_loop_list) < 0)
+    {
+        console_log(LOG_ERR, "\t", "Error joining event loop thread", NULL);
+        exit(1);
     }
-
-    if (!tls_listen_socket_list) {
-        console_log(LOG_ERR, "\t", "Nothing to accept", NULL);
+    if (thread_list_join(listen_socket_list) < 0) {
+        console_log(LOG_ERR, "\t", "Error joining accept thread", NULL);
         exit(1);
     }
-    listen_socket_current = tls_listen_socket_list;
-    while (listen_socket_current) {
-        if (pthread_join(listen_socket_current->thread, NULL) != 0) {
-            console_log(LOG_ERR, "\t", "Error joining accept thread", NULL);
-            exit(1);
-        }
-        listen_socket_current = listen_socket_current->next;
+    if (thread_list_join(tls_listen_socket_list) < 0) {
+        console_log(LOG_ERR, "\t", "Error joining accept thread", NULL);
+        exit(1);
     }
 
-
     return 0;
 }
 
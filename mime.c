@@ -0,0 +1,291 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    mime.c: MIME type resolution
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include <magic.h>
+
+#include "log.h"
+
+#include "mime.h"
+
+#define MIME_EXT_MAX    8
+#define MIME_TABLE_BITS 9
+#define MIME_HASH_SEED  0x485
+
+typedef struct {
+    const char *ext;
+    const char *type;
+} mime_entry_t;
+
+/* Perfect hash of lowercase extensions, no two share a slot. Adding one
+   means finding a new MIME_HASH_SEED that keeps it so and reslotting */
+static const mime_entry_t mime_table[1 << MIME_TABLE_BITS] = {
+    [3] = { "ppt", "application/vnd.ms-powerpoint" },
+    [12] = { "tiff", "image/tiff" },
+    [31] = { "m4a", "audio/mp4" },
+    [32] = { "java", "text/x-java" },
+    [40] = { "go", "text/x-go" },
+    [43] = { "epub", "application/epub+zip" },
+    [48] = { "rs", "text/x-rust" },
+    [50] = { "zip", "application/zip" },
+    [62] = { "js", "text/javascript" },
+    [63] = { "html", "text/html" },
+    [73] = { "opus", "audio/opus" },
+    [77] = { "xls", "application/vnd.ms-excel" },
+    [78] = { "py", "text/x-python" },
+    [80] = { "bmp", "image/bmp" },
+    [82] = { "atom", "application/atom+xml" },
+    [87] = { "7z", "application/x-7z-compressed" },
+    [93] = { "wasm", "application/wasm" },
+    [96] = { "gif", "image/gif" },
+    [98] = { "mkv", "video/x-matroska" },
+    [99] = { "ogv", "video/ogg" },
+    [108] = { "json", "application/json" },
+    [110] = { "m4v", "video/mp4" },
+    [127] = { "oga", "audio/ogg" },
+    [138] = { "sh", "application/x-sh" },
+    [139] = { "c", "text/x-c" },
+    [141] = { "txt", "text/plain" },
+    [148] = { "exe", "application/vnd.microsoft.portable-executable" },
+    [155] = { "webm", "video/webm" },
+    [157] = { "toml", "application/toml" },
+    [162] = { "csv", "text/csv" },
+    [190] = { "deb", "application/vnd.debian.binary-package" },
+    [191] = { "htm", "text/html" },
+    [192] = { "eot", "application/vnd.ms-fontobject" },
+    [198] = { "bin", "application/octet-stream" },
+    [205] = { "woff2", "font/woff2" },
+    [208] = { "h", "text/x-c" },
+    [217] = { "mov", "video/quicktime" },
+    [227] = { "rss", "application/rss+xml" },
+    [229] = { "md", "text/markdown" },
+    [230] = { "odp", "application/vnd.oasis.opendocument.presentation" },
+    [231] = { "jar", "application/java-archive" },
+    [233] = { "xml", "application/xml" },
+    [234] = { "png", "image/png" },
+    [235] = { "mp4", "video/mp4" },
+    [236] = { "ods", "application/vnd.oasis.opendocument.spreadsheet" },
+    [240] = { "odt", "application/vnd.oasis.opendocument.text" },
+    [249] = { "css", "text/css" },
+    [258] = { "log", "text/plain" },
+    [265] = { "rpm", "application/x-rpm" },
+    [280] = { "xz", "application/x-xz" },
+    [297] = { "yaml", "application/yaml" },
+    [298] = { "avif", "image/avif" },
+    [303] = { "avi", "video/x-msvideo" },
+    [316] = { "svg", "image/svg+xml" },
+    [317] = { "pdf", "application/pdf" },
+    [320] = { "mp3", "audio/mpeg" },
+    [331] = { "aac", "audio/aac" },
+    [333] = { "otf", "font/otf" },
+    [342] = { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+    [349] = { "yml", "application/yaml" },
+    [351] = { "jpeg", "image/jpeg" },
+    [353] = { "zst", "application/zstd" },
+    [365] = { "ini", "text/plain" },
+    [367] = { "ttf", "font/ttf" },
+    [375] = { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+    [378] = { "woff", "font/woff" },
+    [381] = { "tgz", "application/gzip" },
+    [383] = { "vcf", "text/vcard" },
+    [388] = { "iso", "application/x-iso9660-image" },
+    [393] = { "flac", "audio/flac" },
+    [399] = { "rar", "application/vnd.rar" },
+    [406] = { "gz", "application/gzip" },
+    [418] = { "ogg", "audio/ogg" },
+    [425] = { "rtf", "application/rtf" },
+    [426] = { "apk", "application/vnd.android.package-archive" },
+    [431] = { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+    [433] = { "wav", "audio/wav" },
+    [441] = { "ico", "image/vnd.microsoft.icon" },
+    [450] = { "mjs", "text/javascript" },
+    [459] = { "conf", "text/plain" },
+    [461] = { "doc", "application/msword" },
+    [464] = { "jpg", "image/jpeg" },
+    [468] = { "ics", "text/calendar" },
+    [469] = { "tif", "image/tiff" },
+    [498] = { "bz2", "application/x-bzip2" },
+    [501] = { "tar", "application/x-tar" },
+    [511] = { "webp", "image/webp" },
+};
+
+/* libmagic cookies can't be shared between threads, each has its own */
+static pthread_key_t magic_key;
+static pthread_once_t magic_key_once = PTHREAD_ONCE_INIT;
+static __thread magic_t magic_cookie = NULL;
+static int magic_unavailable = 0;   /* database failed to load at start */
+
+/* libmagic results, kept for good so callers can hold on to them */
+typedef struct mime_intern_s {
+    struct mime_intern_s *next;
+    char type[];
+} mime_intern_t;
+
+static mime_intern_t *mime_interned = NULL;
+static pthread_mutex_t mime_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+uint32_t
+mime_hash(const char *ext, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)ext[i];
+        h *= 16777619u;
+    }
+    return ((h ^ MIME_HASH_SEED) * 0x9E3779B1u) >> (32 - MIME_TABLE_BITS);
+}
+
+/* Type by file extension, NULL if unknown */
+const char *
+mime_by_ext(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/'))
+        return NULL;
+
+    char ext[MIME_EXT_MAX + 1];
+    size_t len = 0;
+    for (dot++; dot[len]; len++) {
+        if (len == MIME_EXT_MAX)
+            return NULL;
+        ext[len] = tolower((unsigned char)dot[len]);
+    }
+    ext[len] = '\0';
+
+    const mime_entry_t *entry = &mime_table[mime_hash(ext, len)];
+    if (entry->ext && strcmp(entry->ext, ext) == 0)
+        return entry->type;
+    return NULL;
+}
+
+const char *
+mime_intern(const char *type) {
+    pthread_mutex_lock(&mime_intern_lock);
+    mime_intern_t *current = mime_interned;
+    while (current) {
+        if (strcmp(current->type, type) == 0)
+            break;
+        current = current->next;
+    }
+    if (!current) {
+        size_t len = strlen(type);
+        current = malloc(sizeof(mime_intern_t) + len + 1);
+        if (current) {
+            memcpy(current->type, type, len + 1);
+            current->next = mime_interned;
+            mime_interned = current;
+        }
+    }
+    pthread_mutex_unlock(&mime_intern_lock);
+    return current ? current->type : MIME_DEFAULT;
+}
+
+void
+magic_thread_destroy(void *ptr) {
+    magic_close(ptr);
+}
+
+void
+magic_key_create(void) {
+    pthread_key_create(&magic_key, magic_thread_destroy);
+}
+
+magic_t
+magic_thread(void) {
+    if (magic_cookie)
+        return magic_cookie;
+    if (magic_unavailable)
+        return NULL;
+
+    pthread_once(&magic_key_once, magic_key_create);
+    magic_t cookie = magic_open(MAGIC_MIME_TYPE);
+    if (!cookie) {
+        console_log(LOG_ERR, NULL, "Error magic_opening: ", strerror(errno));
+        return NULL;
+    }
+    if (magic_load(cookie, NULL) < 0) {
+        console_log(LOG_ERR, NULL, "Error magic_loading: ",
+            magic_error(cookie));
+        magic_close(cookie);
+        return NULL;
+    }
+    pthread_setspecific(magic_key, cookie);
+    magic_cookie = cookie;
+    return cookie;
+}
+
+/* Exports */
+
+/* Check the extension table and that the magic database loads */
+int
+mime_init(void) {
+    /* Laid out by hand, an entry out of its slot is never found */
+    int r = 0;
+    for (uint32_t i = 0; i < 1 << MIME_TABLE_BITS; i++) {
+        const char *ext = mime_table[i].ext;
+        if (!ext)
+            continue;
+        uint32_t slot = mime_hash(ext, strlen(ext));
+        if (slot != i || strlen(ext) > MIME_EXT_MAX) {
+            printf("Error: mime_table entry %s in slot %u, hashes to %u\n",
+                ext, i, slot);
+            r = -1;
+        }
+    }
+
+    if (!magic_thread()) {
+        printf("Error loading magic database, falling back to %s\n",
+            MIME_DEFAULT);
+        magic_unavailable = 1;
+        return -1;
+    }
+    return r;
+}
+
+/* Serving threads load their magic database as they start, not on the
+   first request that needs it */
+void
+mime_thread_init(void) {
+    magic_thread();
+}
+
+/* Extension table first, libmagic for the rest. The result stays valid
+   for the life of the process */
+const char *
+mime_type(const char *path) {
+    const char *type = mime_by_ext(path);
+    if (type)
+        return type;
+
+    magic_t cookie = magic_thread();
+    if (!cookie)
+        return MIME_DEFAULT;
+    type = magic_file(cookie, path);
+    return type ? mime_intern(type) : MIME_DEFAULT;
+}
@@ -0,0 +1,214 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    pool.c: Bounded worker thread pool
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "config.h"
+#include "log.h"
+#include "http.h"
+#include "socket_util.h"
+#include "mime.h"
+
+#include "pool.h"
+
+typedef struct {
+    void *(*fn)(void*);
+    conn_t *conn;
+    struct timespec queued;
+} pool_job_t;
+
+/* Bounded lock-free MPMC queue, Vyukov style: each cell's sequence number
+   tells producers and consumers whose turn it is */
+typedef struct {
+    size_t seq;
+    pool_job_t job;
+} pool_cell_t;
+
+static struct {
+    pool_cell_t *cells;
+    size_t mask;
+    size_t depth;   /* admission limit, <= mask + 1 */
+    size_t enqueue_pos __attribute__ ((aligned(64)));
+    size_t dequeue_pos __attribute__ ((aligned(64)));
+    sem_t items;
+} pool;
+
+
+int
+pool_push(const pool_job_t *job) {
+    size_t pos = __atomic_load_n(&pool.enqueue_pos, __ATOMIC_RELAXED);
+    pool_cell_t *cell;
+
+    while (1) {
+        if (pos - __atomic_load_n(&pool.dequeue_pos, __ATOMIC_RELAXED) >=
+            pool.depth)
+            return -1;
+        cell = &pool.cells[pos & pool.mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&pool.enqueue_pos, &pos, pos + 1,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1; /* full */
+        } else {
+            pos = __atomic_load_n(&pool.enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->job = *job;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+pool_pop(pool_job_t *job) {
+    size_t pos = __atomic_load_n(&pool.dequeue_pos, __ATOMIC_RELAXED);
+    pool_cell_t *cell;
+
+    while (1) {
+        cell = &pool.cells[pos & pool.mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&pool.dequeue_pos, &pos, pos + 1,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1; /* empty */
+        } else {
+            pos = __atomic_load_n(&pool.dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *job = cell->job;
+    __atomic_store_n(&cell->seq, pos + pool.mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+long
+ms_since(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 +
+        (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+void
+pool_shed(conn_t *conn) {
+    http_reject(&conn->cs);
+    cs_close(&conn->cs);
+    conn_free(conn);
+}
+
+void *
+pool_worker(void *ptr) {
+    (void)ptr;
+    pool_job_t job;
+    mime_thread_init();
+
+    while (1) {
+        if (sem_wait(&pool.items) < 0)
+            continue; /* EINTR */
+        /* The token guarantees a job, but with several accept threads
+           pushing, an earlier slot may still be being filled in */
+        while (pool_pop(&job) < 0)
+            sched_yield();
+
+        /* Waited too long, the client is better off with a quick 503 */
+        if (worker_queue_delay > 0 &&
+            ms_since(&job.queued) > worker_queue_delay)
+        {
+            pool_shed(job.conn);
+            continue;
+        }
+
+        job.fn(job.conn);
+    }
+}
+
+/* Exports */
+
+int
+pool_start(int workers, int queue) {
+    size_t size = 1;
+    while (size < (size_t)queue) size <<= 1;
+
+    pool.cells = malloc(size * sizeof(pool_cell_t));
+    if (!pool.cells) {
+        printf("Error allocating worker queue\n");
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++)
+        pool.cells[i].seq = i;
+    pool.mask = size - 1;
+    pool.depth = queue;
+    pool.enqueue_pos = 0;
+    pool.dequeue_pos = 0;
+    sem_init(&pool.items, 0, 0);
+
+    for (int i = 0; i < workers; i++) {
+        pthread_t worker_thread;
+        if (pthread_create(&worker_thread, NULL, pool_worker, NULL) != 0) {
+            printf("Error creating worker thread: %s\n", strerror(errno));
+            return -1;
+        }
+        pthread_detach(worker_thread);
+    }
+
+    printf("started %d worker threads\n", workers);
+
+    return workers;
+}
+
+/* Whether connections are queued for a worker */
+int
+pool_waiting(void) {
+    return __atomic_load_n(&pool.enqueue_pos, __ATOMIC_RELAXED) !=
+        __atomic_load_n(&pool.dequeue_pos, __ATOMIC_RELAXED);
+}
+
+/* Hand a connection to the pool, answered 503 if the queue is full */
+int
+pool_submit(void *(*fn)(void*), conn_t *conn) {
+    pool_job_t job;
+    job.fn = fn;
+    job.conn = conn;
+    clock_gettime(CLOCK_MONOTONIC, &job.queued);
+
+    if (pool_push(&job) < 0) {
+        pool_shed(conn);
+        return -1;
+    }
+    sem_post(&pool.items);
+    return 0;
+}
@@ -0,0 +1,32 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include "socket_util.h"
+
+#define POOL_IDLE_CHECK 200 /* ms, idle pooled connections look at the queue */
+
+int pool_start(int workers, int queue);
+int pool_submit(void *(*fn)(void*), conn_t *conn);
+int pool_waiting(void);
+
+#endif
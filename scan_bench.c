@@ -0,0 +1,152 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    scan_bench.c: Header scanning kernels microbenchmark
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_parser.h"
+
+#define BENCH_ROUNDS    200000
+
+/* Typical browser requests, the last one with a session heavy cookie */
+static const char *req_chrome =
+    "GET /static/css/main.css HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", "
+        "\"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+        "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 "
+        "Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Referer: https://www.example.org/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,es;q=0.8\r\n"
+    "\r\n";
+
+static const char *req_firefox =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+        "Firefox/119.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "DNT: 1\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "If-Modified-Since: Tue, 10 Oct 2023 08:12:31 GMT\r\n"
+    "If-None-Match: \"652507bf-1a2b\"\r\n"
+    "\r\n";
+
+static const char *req_curl =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+typedef struct {
+    const char *name;
+    char *buff;
+    size_t len;
+} bench_req_t;
+
+
+
+/* Firefox request plus a ~4KB analytics and session cookie */
+char *
+make_cookie_req(void) {
+    size_t size = 8192;
+    char *buff = malloc(size);
+    size_t len = snprintf(buff, size, "%.*s", (int)(strlen(req_firefox) - 2),
+        req_firefox);
+    len += snprintf(buff + len, size - len, "Cookie: ");
+    for (int i = 0; len < 4600; i++)
+        len += snprintf(buff + len, size - len,
+            "%s_ga_%d=GS1.1.1697443012.%d.1.1697443555.0.0.0; ",
+            i ? "" : "sid=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d;"
+            " ", i, i * 7);
+    len += snprintf(buff + len, size - len, "theme=dark\r\n\r\n");
+    return buff;
+}
+
+double
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Full parse of req, ns per request */
+double
+bench(const bench_req_t *req) {
+    http_request_t parser;
+    size_t check = 0;
+
+    double start = now_ns();
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        http_parser_init(&parser);
+        check += http_parse(&parser, req->buff, req->len);
+        check += parser.nheaders;
+    }
+    double ns = (now_ns() - start) / BENCH_ROUNDS;
+
+    if (check == 0) printf("parse failed\n");
+    return ns;
+}
+
+int
+main(void) {
+    bench_req_t reqs[] = {
+        { "curl",    strdup(req_curl),    0 },
+        { "chrome",  strdup(req_chrome),  0 },
+        { "firefox", strdup(req_firefox), 0 },
+        { "cookie",  make_cookie_req(),   0 },
+    };
+    int nreqs = sizeof(reqs) / sizeof(reqs[0]);
+
+    printf("%-10s %6s %15s %10s\n", "request", "bytes", "parse", "rate");
+    for (int r = 0; r < nreqs; r++) {
+        reqs[r].len = strlen(reqs[r].buff);
+        double ns = bench(&reqs[r]);
+        printf("%-10s %6zu %8.1f ns/req %5.2f GB/s\n", reqs[r].name,
+            reqs[r].len, ns, reqs[r].len / ns);
+    }
+
+    for (int r = 0; r < nreqs; r++)
+        free(reqs[r].buff);
+
+    return 0;
+}
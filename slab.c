@@ -0,0 +1,157 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    slab.c: Fixed size object pools
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#include "slab.h"
+
+/* Precedes every object, points back to its slab while in use and to the
+   next free object while not */
+typedef union {
+    slab_t *owner;
+    void *next;
+    max_align_t align;
+} slab_hdr_t;
+
+/* Vars */
+static slab_t *slab_list = NULL;
+static pthread_mutex_t slab_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+slab_t *
+slab_create(const char *name, size_t size, size_t perchunk) {
+    slab_t *slab = calloc(1, sizeof(slab_t));
+    if (!slab) return NULL;
+    snprintf(slab->name, sizeof(slab->name), "%s", name);
+    slab->size = sizeof(slab_hdr_t) +
+        ((size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1));
+    slab->perchunk = perchunk > 0 ? perchunk : 1;
+    pthread_mutex_init(&slab->lock, NULL);
+
+    pthread_mutex_lock(&slab_list_lock);
+    slab->next = slab_list;
+    slab_list = slab;
+    pthread_mutex_unlock(&slab_list_lock);
+
+    return slab;
+}
+
+/* Thread the objects of a new chunk onto the free list, called locked */
+int
+slab_grow(slab_t *slab) {
+    char *chunk = malloc(slab->size * slab->perchunk);
+    if (!chunk) return -1;
+    for (size_t i = 0; i < slab->perchunk; i++) {
+        slab_hdr_t *hdr = (slab_hdr_t*)(chunk + i * slab->size);
+        hdr->next = slab->free;
+        slab->free = hdr;
+    }
+    slab->total += slab->perchunk;
+    return 0;
+}
+
+void *
+slab_alloc(slab_t *slab) {
+    pthread_mutex_lock(&slab->lock);
+    if (!slab->free && slab_grow(slab) < 0) {
+        pthread_mutex_unlock(&slab->lock);
+        return NULL;
+    }
+    slab_hdr_t *hdr = slab->free;
+    slab->free = hdr->next;
+    if (++slab->used > slab->peak)
+        slab->peak = slab->used;
+    pthread_mutex_unlock(&slab->lock);
+
+    hdr->owner = slab;
+    return hdr + 1;
+}
+
+/* Back to the slab it came from, from any thread */
+void
+slab_free(void *obj) {
+    if (!obj) return;
+    slab_hdr_t *hdr = (slab_hdr_t*)obj - 1;
+    slab_t *slab = hdr->owner;
+
+    pthread_mutex_lock(&slab->lock);
+    hdr->next = slab->free;
+    slab->free = hdr;
+    slab->used--;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+/* Log occupancy of the slabs that changed since the last report */
+void
+slab_report(void) {
+    char msg[256];
+
+    pthread_mutex_lock(&slab_list_lock);
+    for (slab_t *slab = slab_list; slab; slab = slab->next) {
+        pthread_mutex_lock(&slab->lock);
+        size_t used = slab->used, total = slab->total, peak = slab->peak;
+        int changed = used != slab->reported;
+        slab->reported = used;
+        pthread_mutex_unlock(&slab->lock);
+
+        if (!changed) continue;
+        snprintf(msg, 256, "%s pool: %zu in use, %zu allocated, peak %zu, "
+            "%zu KiB", slab->name, used, total, peak,
+            total * slab->size / 1024);
+        console_log(LOG_INFO, NULL, msg, NULL);
+    }
+    pthread_mutex_unlock(&slab_list_lock);
+}
+
+void *
+slab_report_loop(void *ptr) {
+    int interval = *(int*)ptr;
+    while (1) {
+        sleep(interval);
+        slab_report();
+    }
+}
+
+/* Report every interval seconds */
+int
+slab_report_start(int interval) {
+    static int report_interval;
+    report_interval = interval;
+
+    pthread_t report_thread;
+    if (pthread_create(&report_thread, NULL, slab_report_loop,
+        &report_interval) != 0)
+    {
+        printf("Error creating pool report thread: %s\n", strerror(errno));
+        return -1;
+    }
+    pthread_detach(report_thread);
+    return 0;
+}
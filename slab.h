@@ -0,0 +1,49 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+
+#include <pthread.h>
+
+/* Structs */
+/* Pool of fixed size objects, grown a chunk at a time and recycled through
+   a free list, memory is never handed back */
+typedef struct slab_s {
+    char name[32];
+    size_t size;            /* object stride, header included */
+    size_t perchunk;
+    void *free;
+    size_t used, total, peak;
+    size_t reported;        /* used at the last report */
+    pthread_mutex_t lock;
+    struct slab_s *next;    /* all slabs, for reporting */
+} slab_t;
+
+slab_t *slab_create(const char *name, size_t size, size_t perchunk);
+void *slab_alloc(slab_t *slab);
+void slab_free(void *obj);
+
+void slab_report(void);
+int slab_report_start(int interval);
+
+#endif
@@ -30,6 +30,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <sys/time.h>
 
 #include <pthread.h>
 
@@ -37,15 +38,18 @@
 #include "strutils.h"
 #include "log.h"
 #include "http.h"
+#include "event.h"
+#include "uring.h"
 
 #include "socket_util.h"
+#include "pool.h"
 #include "socket.h"
 
 /* Vars */
 fd_thread_node_t *listen_socket_list = NULL;
 
 int
-socket_listen(struct addrinfo *addr, unsigned short port) {
+socket_listen(struct addrinfo *addr, unsigned short port, int reuseport) {
     /* Set port */
     if (addr->ai_family == AF_INET)
         ((struct sockaddr_in*)addr->ai_addr)->sin_port = htons(port);
@@ -64,6 +68,14 @@ socket_listen(struct addrinfo *addr, unsigned short port) {
         return -1;
     }
 
+    /* Several sockets on the same port, the kernel balances among them */
+    if (reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+    {
+        printf("Error setting option SO_REUSEPORT socket: %s\n", strerror(errno));
+        return -1;
+    }
+
     /* Bind socket */
     if (bind(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
         printf("Error binding socket: %s\n", strerror(errno));
@@ -81,25 +93,63 @@ socket_listen(struct addrinfo *addr, unsigned short port) {
 
 void *
 receive_loop(void *ptr) {
-    client_t *cs = (client_t*)ptr;
+    conn_t *conn = (conn_t*)ptr;
+    client_t *cs = &conn->cs;
     int cfd = cs->fd;
     const char *addrstr = cs->addrstr;
-    char recvbuff[BUFF_SIZE];
+    char *recvbuff = conn->recvbuff;
+    size_t bufflen = 0;
+
+    /* Idle connections time out between requests. Pooled ones wake up
+       every POOL_IDLE_CHECK to hand their worker over to queued ones */
+    cs->pooled = worker_threads > 0;
+    int slice = cs->pooled ? POOL_IDLE_CHECK : keepalive_timeout * 1000;
+    int idle = 0; /* ms */
+    struct timeval tv = { slice / 1000, (slice % 1000) * 1000 };
+    if (slice > 0)
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
     while (1) {
-        int recvlen = read(cfd, recvbuff, BUFF_SIZE);
-        if (recvlen < 0) {
-            console_log(LOG_ERR, addrstr, "Error reading client: ",
-                strerror(errno));
-            return NULL;
+        int recvlen = read(cfd, recvbuff + bufflen, BUFF_SIZE - 1 - bufflen);
+        if (recvlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            cs->pooled)
+        {
+            idle += slice;
+            if (keepalive_timeout > 0 && idle >= keepalive_timeout * 1000) {
+                console_log(LOG_DBG, addrstr, "Keep-alive timeout", NULL);
+                break;
+            }
+            if (bufflen == 0 && cs->requests > 0 && pool_waiting()) {
+                console_log(LOG_DBG, addrstr, "Keep-alive given up", NULL);
+                break;
+            }
+            continue;
+        } else if (recvlen < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                console_log(LOG_DBG, addrstr, "Keep-alive timeout", NULL);
+            else
+                console_log(LOG_ERR, addrstr, "Error reading client: ",
+                    strerror(errno));
+            break;
         } else if (recvlen == 0) {
             console_log(LOG_DBG, addrstr, "Client disconnected", NULL);
-            return NULL;
+            break;
         } else {
-            http_process(cs, recvbuff, recvlen);
-            return NULL;
+            idle = 0;
+            bufflen += recvlen;
+            recvbuff[bufflen] = '\0';
+            ssize_t used = http_process_buffer(cs, recvbuff, bufflen);
+            if (used < 0)
+                break;
+            /* Keep the start of the next request */
+            memmove(recvbuff, recvbuff + used, bufflen - used);
+            bufflen -= used;
         }
     }
+
+    cs_close(cs);
+    conn_free(conn);
+    return NULL;
 }
 
 void *
@@ -111,6 +161,14 @@ accept_loop(void *ptr) {
     char lfdstr[16];
     snprintf(lfdstr, 16, "%d", lfd);
 
+    char slabname[32];
+    snprintf(slabname, 32, "listener %d conn", lfd);
+    slab_t *conns = slab_create(slabname, sizeof(conn_t), 16);
+    if (!conns) {
+        console_log(LOG_ERR, lfdstr, "Error creating connection pool", NULL);
+        return NULL;
+    }
+
     while (1) {
         cfd = accept(lfd, &sa, &salen);
         if (cfd < 0) {
@@ -118,43 +176,69 @@ accept_loop(void *ptr) {
             return NULL;
         }
 
-        char *addrstr = malloc(128);
-        client_t *cs = malloc(sizeof(client_t));
-        cs->addrstr = addrstr;
-        cs->fd = cfd;
-        cs->ctx = NULL;
+        conn_t *conn = conn_new(conns, cfd, &sa);
+        if (!conn) {
+            console_log(LOG_ERR, lfdstr, "Out of connections", NULL);
+            close(cfd);
+            continue;
+        }
+        console_log(LOG_DBG, conn->addrstr, "Accepted client", NULL);
 
-        sa_addr_str(&sa, addrstr, 128);
-        console_log(LOG_DBG, addrstr, "Accepted client", NULL);
+        /* Hand over to the worker pool, it sheds load when saturated */
+        if (worker_threads > 0) {
+            pool_submit(receive_loop, conn);
+            continue;
+        }
 
         /* Create thread for every incoming connection */
         pthread_t recv_thread;
-        pthread_create(&recv_thread, NULL, receive_loop, cs);
+        pthread_create(&recv_thread, NULL, receive_loop, conn);
         pthread_detach(recv_thread);
     }
 }
 
+/* shard < 0 is a single listener, otherwise one of several SO_REUSEPORT
+   listeners with its own accept loop */
 int
-socket_listen_accept(struct addrinfo *ai, unsigned short port) {
+socket_listen_accept(struct addrinfo *ai, unsigned short port, int shard) {
     /* listen */
-    int lfd = socket_listen(ai, port);
+    int lfd = socket_listen(ai, port, shard >= 0);
     if (lfd < 0) return -1;
 
     /* push element */
     fd_thread_node_t* node = fd_thread_list_push(&listen_socket_list, lfd, 0);
 
+    /* event loops accept by themselves */
+    if (server_mode == SERVER_EPOLL)
+        return event_add_listener(lfd, shard, NULL);
+    if (server_mode == SERVER_URING)
+        return uring_add_listener(lfd, shard);
+
     /* run accept thread */
     pthread_t accept_thread;
     pthread_create(&accept_thread, NULL, accept_loop, &node->fd);
 
     node->thread = accept_thread;
+    if (shard >= 0)
+        thread_pin_cpu(accept_thread, shard);
 
     return lfd;
 }
 
+void
+socket_listen_shards(struct addrinfo *ai, unsigned short port, int workers,
+    const char *addrstr)
+{
+    int n = workers > 0 ? workers : 1;
+    for (int i = 0; i < n; i++) {
+        int lfd = socket_listen_accept(ai, port, workers > 0 ? i : -1);
+        printf("listening %s:%d %d\n", addrstr, port, lfd);
+    }
+}
+
 int
-server_start(string_node_t *listen_list) {
-    string_node_t *listen_current = listen_list;
+server_start(listen_node_t *listen_list) {
+    listen_node_t *listen_current = listen_list;
     char addrstr[128];
     char portstr[8];
     struct addrinfo *ai;
@@ -177,8 +261,7 @@ server_start(string_node_t *listen_list) {
 
             ai_addr_str(ai, addrstr, 256, 1);
 
-            int lfd = socket_listen_accept(ai, port);
-            printf("listening %s:%d %d\n", addrstr, port, lfd);
+            socket_listen_shards(ai, port, listen_current->workers, addrstr);
         } else { /* assume port */
             port = atoi(listen_current->str);
 
@@ -186,9 +269,7 @@ server_start(string_node_t *listen_list) {
 
             host_resolve("0.0.0.0", &ai);
             ai_addr_str(ai, addrstr, 256, 1);
-            int lfd = socket_listen_accept(ai, port);
-
-            printf("listening %s:%d %d\n", addrstr, port, lfd);
+            socket_listen_shards(ai, port, listen_current->workers, addrstr);
         }
 
         listen_current = listen_current->next;
@@ -25,6 +25,6 @@
 
 extern fd_thread_node_t *listen_socket_list;
 
-int server_start(string_node_t *listen_list);
+int server_start(listen_node_t *listen_list);
 
 #endif
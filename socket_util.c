@@ -20,6 +20,8 @@
 
 */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+
 #include <stdlib.h>
 
 #include <unistd.h>
@@ -27,6 +29,8 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "strutils.h"
 
@@ -51,6 +55,18 @@ fd_thread_list_push(fd_thread_node_t **head, int fd, pthread_t thread) {
     return new;
 }
 
+/* Pin thread to the n-th online core, wrapping around */
+int
+thread_pin_cpu(pthread_t thread, int n) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0) return -1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(n % ncpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+}
+
 int
 host_resolve(const char *host, struct addrinfo **addrs) {
     struct addrinfo hints = { 0 };
@@ -99,3 +115,17 @@ sa_addr_str(const struct sockaddr *addr, char *str, size_t strlen) {
 
     return r;
 }
+
+conn_t *
+conn_new(slab_t *slab, int fd, const struct sockaddr *sa) {
+    conn_t *conn = slab_alloc(slab);
+    if (!conn) return NULL;
+    cs_init(&conn->cs, fd, NULL, conn->addrstr);
+    sa_addr_str(sa, conn->addrstr, 128);
+    return conn;
+}
+
+void
+conn_free(conn_t *conn) {
+    slab_free(conn);
+}
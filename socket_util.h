@@ -24,10 +24,24 @@
 #include <netdb.h>
 
 #include "config.h"
+#include "http.h"
+#include "slab.h"
+
+/* Structs */
+/* Connection of the threaded servers, recycled through its listener's slab */
+typedef struct {
+    client_t cs;
+    char addrstr[128];
+    char recvbuff[BUFF_SIZE];
+} conn_t;
 
 fd_thread_node_t *fd_thread_list_push(fd_thread_node_t **head, int fd, pthread_t thread);
+int thread_pin_cpu(pthread_t thread, int n);
 int host_resolve(const char *host, struct addrinfo **addrs);
 int ai_addr_str(const struct addrinfo *addr, char *str, size_t strlen, int flags);
 int sa_addr_str(const struct sockaddr *addr, char *str, size_t strlen);
 
+conn_t *conn_new(slab_t *slab, int fd, const struct sockaddr *sa);
+void conn_free(conn_t *conn);
+
 #endif
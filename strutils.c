@@ -24,6 +24,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 size_t /* from BSD */
 strlcat(char *dst, const char *src, size_t dstsize) {
@@ -54,6 +55,45 @@ strlcat(char *dst, const char *src, size_t dstsize) {
     return d_len + s_len;
 }
 
+void
+strbuf_init(strbuf_t *sb, char *buff, size_t size) {
+    sb->buff = buff;
+    sb->size = size;
+    sb->len = 0;
+    if (size > 0)
+        buff[0] = '\0';
+}
+
+void
+strbuf_append(strbuf_t *sb, const char *src, size_t n) {
+    if (sb->len + 1 >= sb->size)
+        return;
+    if (n > sb->size - 1 - sb->len)
+        n = sb->size - 1 - sb->len;
+    memcpy(sb->buff + sb->len, src, n);
+    sb->len += n;
+    sb->buff[sb->len] = '\0';
+}
+
+void
+strbuf_cat(strbuf_t *sb, const char *src) {
+    strbuf_append(sb, src, strlen(src));
+}
+
+void
+strbuf_printf(strbuf_t *sb, const char *fmt, ...) {
+    if (sb->len + 1 >= sb->size)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    int r = vsnprintf(sb->buff + sb->len, sb->size - sb->len, fmt, ap);
+    va_end(ap);
+    if (r < 0)
+        return;
+    sb->len += (size_t)r < sb->size - sb->len ? (size_t)r :
+        sb->size - 1 - sb->len;
+}
+
 void
 strsub(char *dest, size_t destsize, const char *src, size_t n) {
     int i = 0;
@@ -86,7 +126,39 @@ human_size(int isize, char *buf, size_t buflen) {
 
 const char *
 strnchr(const char *str, size_t n, char chr) {
-    for (int i = 0; i < n; i++)
-        if (str[i] == chr) return str + i;
-    return NULL;
+    return memchr(str, chr, n);
+}
+
+int
+hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Percent-decode n bytes of src into dst, terminated. Returns the decoded
+   length, or -1 on a bad escape, an escaped NUL or no room */
+ssize_t
+url_decode(char *dst, size_t dstsize, const char *src, size_t n) {
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        char c = src[i];
+        if (c == '%') {
+            if (i + 2 >= n)
+                return -1;
+            int hi = hex_digit(src[i + 1]), lo = hex_digit(src[i + 2]);
+            if (hi < 0 || lo < 0 || (hi | lo) == 0)
+                return -1;
+            c = hi << 4 | lo;
+            i += 2;
+        }
+        if (len + 1 >= dstsize)
+            return -1;
+        dst[len++] = c;
+    }
+    if (dstsize == 0)
+        return -1;
+    dst[len] = '\0';
+    return len;
 }
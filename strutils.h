@@ -22,11 +22,28 @@
 #define _STRUTILS_H
 
 #include <stdlib.h>
+#include <sys/types.h>
+
+/* String built into a fixed buffer, keeps its length so appending never
+   rescans it. Truncated at size - 1, always terminated */
+typedef struct {
+    char *buff;
+    size_t size;
+    size_t len;
+} strbuf_t;
+
+/* Literals know their length already */
+#define strbuf_lit(sb, s) strbuf_append((sb), (s), sizeof(s) - 1)
 
 size_t strlcat(char *dst, const char *src, size_t dstsize);
+void strbuf_init(strbuf_t *sb, char *buff, size_t size);
+void strbuf_append(strbuf_t *sb, const char *src, size_t n);
+void strbuf_cat(strbuf_t *sb, const char *src);
+void strbuf_printf(strbuf_t *sb, const char *fmt, ...);
 void strsub(char *dest, size_t destsize, const char *src, size_t n);
 char *stralloccpy(const char *start, size_t length);
 char *human_size(int size, char *buf, size_t buflen);
 const char *strnchr(const char *str, size_t n, char chr);
+ssize_t url_decode(char *dst, size_t dstsize, const char *src, size_t n);
 
 #endif
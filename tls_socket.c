@@ -25,6 +25,12 @@
 #include <string.h>
 #include <errno.h>
 
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/random.h>
+#include <poll.h>
+
 #include <tls.h>
 
 #include <pthread.h>
@@ -34,6 +40,8 @@
 #include "log.h"
 #include "http.h"
 #include "socket_util.h"
+#include "pool.h"
+#include "event.h"
 
 #include "tls_socket.h"
 
@@ -42,8 +50,11 @@ fd_thread_node_t *tls_listen_socket_list = NULL;
 
 static struct tls *sctx = NULL; /* server tls context */
 
+/* Session resumption */
+static unsigned long tls_handshakes = 0, tls_resumed = 0;
+
 int
-tls_socket_listen(struct addrinfo *addr, unsigned short port) {
+tls_socket_listen(struct addrinfo *addr, unsigned short port, int reuseport) {
     /* Set port */
     if (addr->ai_family == AF_INET)
         ((struct sockaddr_in*)addr->ai_addr)->sin_port = htons(port);
@@ -62,6 +73,14 @@ tls_socket_listen(struct addrinfo *addr, unsigned short port) {
         return -1;
     }
 
+    /* Several sockets on the same port, the kernel balances among them */
+    if (reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+    {
+        printf("Error setting option SO_REUSEPORT socket: %s\n", strerror(errno));
+        return -1;
+    }
+
     /* Bind socket */
     if (bind(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
         printf("Error binding socket: %s\n", strerror(errno));
@@ -77,27 +96,121 @@ tls_socket_listen(struct addrinfo *addr, unsigned short port) {
     return fd;
 }
 
+void *
+tls_report_loop(void *ptr) {
+    (void)ptr;
+    char msg[128];
+    while (1) {
+        sleep(slab_report_interval);
+        unsigned long handshakes = __atomic_load_n(&tls_handshakes,
+            __ATOMIC_RELAXED);
+        unsigned long resumed = __atomic_load_n(&tls_resumed,
+            __ATOMIC_RELAXED);
+        snprintf(msg, 128, "TLS sessions: %lu handshakes, %lu resumed (%.1f%%)",
+            handshakes, resumed,
+            handshakes ? 100.0 * resumed / handshakes : 0.0);
+        console_log(LOG_INFO, "\t", msg, NULL);
+    }
+}
+
+void
+tls_session_count(struct tls *ctx) {
+    __atomic_add_fetch(&tls_handshakes, 1, __ATOMIC_RELAXED);
+    if (tls_conn_session_resumed(ctx))
+        __atomic_add_fetch(&tls_resumed, 1, __ATOMIC_RELAXED);
+}
+
+/* Handshake up front to know if the session was resumed */
+int
+tls_do_handshake(client_t *cs) {
+    while (1) {
+        int r = tls_handshake(cs->ctx);
+        if (r == 0)
+            break;
+        if (r != TLS_WANT_POLLIN && r != TLS_WANT_POLLOUT) {
+            console_log(LOG_DBG, cs->addrstr, "TLS handshake: ",
+                tls_error(cs->ctx));
+            return -1;
+        }
+        /* Stalled client */
+        struct pollfd pfd = { .fd = cs->fd,
+            .events = r == TLS_WANT_POLLIN ? POLLIN : POLLOUT };
+        int timeout = keepalive_timeout > 0 ? keepalive_timeout : STALL_TIMEOUT;
+        if (poll(&pfd, 1, timeout * 1000) <= 0) {
+            console_log(LOG_DBG, cs->addrstr, "TLS handshake timeout", NULL);
+            return -1;
+        }
+    }
+
+    tls_session_count(cs->ctx);
+    return 0;
+}
+
 void *
 tls_receive_loop(void *ptr) {
-    client_t *cs = (client_t*)ptr;
+    conn_t *conn = (conn_t*)ptr;
+    client_t *cs = &conn->cs;
     struct tls *ctx = cs->ctx;
     const char *addrstr = cs->addrstr;
-    char recvbuff[BUFF_SIZE];
+    char *recvbuff = conn->recvbuff;
+    size_t bufflen = 0;
+
+    /* Idle connections time out between requests. Pooled ones wake up
+       every POOL_IDLE_CHECK to hand their worker over to queued ones */
+    cs->pooled = worker_threads > 0;
+    int slice = cs->pooled ? POOL_IDLE_CHECK : keepalive_timeout * 1000;
+    int idle = 0; /* ms */
+    struct timeval tv = { slice / 1000, (slice % 1000) * 1000 };
+    if (slice > 0)
+        setsockopt(cs->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (tls_do_handshake(cs) < 0)
+        goto done;
 
     while (1) {
-        int recvlen = tls_read(ctx, recvbuff, BUFF_SIZE);
-        if (recvlen < 0) {
-            console_log(LOG_ERR, addrstr, "Error reading TLS client: ",
-                strerror(errno));
-            return NULL;
+        int recvlen = tls_read(ctx, recvbuff + bufflen,
+            BUFF_SIZE - 1 - bufflen);
+        /* The timeout surfaces as a want, the connection stays usable */
+        if ((recvlen == TLS_WANT_POLLIN || recvlen == TLS_WANT_POLLOUT) &&
+            cs->pooled)
+        {
+            idle += slice;
+            if (keepalive_timeout > 0 && idle >= keepalive_timeout * 1000) {
+                console_log(LOG_DBG, addrstr, "Keep-alive timeout", NULL);
+                break;
+            }
+            if (bufflen == 0 && cs->requests > 0 && pool_waiting()) {
+                console_log(LOG_DBG, addrstr, "Keep-alive given up", NULL);
+                break;
+            }
+            continue;
+        } else if (recvlen < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                console_log(LOG_DBG, addrstr, "Keep-alive timeout", NULL);
+            else
+                console_log(LOG_ERR, addrstr, "Error reading TLS client: ",
+                    strerror(errno));
+            break;
         } else if (recvlen == 0) {
             console_log(LOG_DBG, addrstr, "Client disconnected", NULL);
-            return NULL;
+            break;
         } else {
-            http_process(cs, recvbuff, recvlen);
-            return NULL;
+            idle = 0;
+            bufflen += recvlen;
+            recvbuff[bufflen] = '\0';
+            ssize_t used = http_process_buffer(cs, recvbuff, bufflen);
+            if (used < 0)
+                break;
+            /* Keep the start of the next request */
+            memmove(recvbuff, recvbuff + used, bufflen - used);
+            bufflen -= used;
         }
     }
+
+    done:
+    cs_close(cs);
+    conn_free(conn);
+    return NULL;
 }
 
 void *
@@ -111,6 +224,14 @@ tls_accept_loop(void *ptr) {
 
     snprintf(lfdstr, 16, "%d", lfd);
 
+    char slabname[32];
+    snprintf(slabname, 32, "listener %d conn", lfd);
+    slab_t *conns = slab_create(slabname, sizeof(conn_t), 16);
+    if (!conns) {
+        console_log(LOG_ERR, lfdstr, "Error creating connection pool", NULL);
+        return NULL;
+    }
+
     while (1) {
         cfd = accept(lfd, &sa, &salen);
         if (cfd < 0) {
@@ -118,16 +239,22 @@ tls_accept_loop(void *ptr) {
             return NULL;
         }
 
-        client_t *cs = malloc(sizeof(client_t));
-        cs->addrstr = malloc(128);
-        cs->fd = cfd;
-        sa_addr_str(&sa, cs->addrstr, 128);
+        conn_t *conn = conn_new(conns, cfd, &sa);
+        if (!conn) {
+            console_log(LOG_ERR, lfdstr, "Out of connections", NULL);
+            close(cfd);
+            continue;
+        }
+        client_t *cs = &conn->cs;
 
         /* TLS accept */
+        cctx = NULL;
         if (tls_accept_socket(sctx, &cctx, cfd) != 0) {
             console_log(LOG_ERR, lfdstr, "Accepting TLS client: ",
-                strerror(errno));
-            return NULL;
+                tls_error(sctx));
+            close(cfd);
+            conn_free(conn);
+            continue;
         }
 
         cs->ctx = cctx;
@@ -137,37 +264,63 @@ tls_accept_loop(void *ptr) {
 
         console_log(LOG_DBG, cs->addrstr, "Accepted TLS client", tls_cipher);
 
+        /* Hand over to the worker pool, it sheds load when saturated */
+        if (worker_threads > 0) {
+            pool_submit(tls_receive_loop, conn);
+            continue;
+        }
+
         /* Create thread for every incoming connection */
         pthread_t recv_thread;
-        pthread_create(&recv_thread, NULL, tls_receive_loop, cs);
+        pthread_create(&recv_thread, NULL, tls_receive_loop, conn);
         pthread_detach(recv_thread);
     }
 }
 
 
+/* shard < 0 is a single listener, otherwise one of several SO_REUSEPORT
+   listeners with its own accept loop */
 int
-tls_socket_listen_accept(struct addrinfo *ai, unsigned short port) {
+tls_socket_listen_accept(struct addrinfo *ai, unsigned short port, int shard) {
     /* listen */
-    int lfd = tls_socket_listen(ai, port);
+    int lfd = tls_socket_listen(ai, port, shard >= 0);
     if (lfd < 0) return -1;
 
     /* push element */
     fd_thread_node_t* node = fd_thread_list_push(&tls_listen_socket_list, lfd, 0);
 
+    /* Event loops drive handshakes and reads without blocking, io_uring
+       has no TLS path and keeps the threaded one */
+    if (server_mode == SERVER_EPOLL)
+        return event_add_listener(lfd, shard, sctx);
+
     /* run accept thread */
     pthread_t accept_thread;
     pthread_create(&accept_thread, NULL, tls_accept_loop, &node->fd);
 
     node->thread = accept_thread;
+    if (shard >= 0)
+        thread_pin_cpu(accept_thread, shard);
 
     return lfd;
 }
 
+void
+tls_socket_listen_shards(struct addrinfo *ai, unsigned short port, int workers,
+    const char *addrstr)
+{
+    int n = workers > 0 ? workers : 1;
+    for (int i = 0; i < n; i++) {
+        int lfd = tls_socket_listen_accept(ai, port, workers > 0 ? i : -1);
+        printf("listening %s:%d %d\n", addrstr, port, lfd);
+    }
+}
+
 int
-tls_server_start(string_node_t *tls_listen_list, const char *cert_file,
+tls_server_start(listen_node_t *tls_listen_list, const char *cert_file,
     const char *cert_key_file)
 {
-    string_node_t *listen_current = tls_listen_list;
+    listen_node_t *listen_current = tls_listen_list;
     char addrstr[128];
     char portstr[8];
     struct addrinfo *ai;
@@ -208,6 +361,26 @@ tls_server_start(string_node_t *tls_listen_list, const char *cert_file,
         return -1;
     }
 
+    /* Session resumption through tickets. The keys are left to libtls,
+       which makes them and rekeys as the session lifetime goes by */
+    if (tls_session_lifetime > 0) {
+        unsigned char sid[TLS_MAX_SESSION_ID_LENGTH];
+        if (getrandom(sid, sizeof(sid), 0) != sizeof(sid) ||
+            tls_config_set_session_id(cfg, sid, sizeof(sid)) != 0 ||
+            tls_config_set_session_lifetime(cfg, tls_session_lifetime) != 0)
+        {
+            printf("Error setting up session resumption: %s\n",
+                tls_config_error(cfg));
+            return -1;
+        }
+
+        if (slab_report_interval > 0) {
+            pthread_t report_thread;
+            pthread_create(&report_thread, NULL, tls_report_loop, NULL);
+            pthread_detach(report_thread);
+        }
+    }
+
     /* Create server context */
     if ((sctx = tls_server()) == NULL) {
         printf("Error creating server context: tls_server\n");
@@ -238,8 +411,7 @@ tls_server_start(string_node_t *tls_listen_list, const char *cert_file,
 
             ai_addr_str(ai, addrstr, 256, 1);
 
-            int lfd = tls_socket_listen_accept(ai, port);
-            printf("listening %s:%d %d\n", addrstr, port, lfd);
+            tls_socket_listen_shards(ai, port, listen_current->workers, addrstr);
         } else { /* assume port */
             port = atoi(listen_current->str);
 
@@ -247,9 +419,7 @@ tls_server_start(string_node_t *tls_listen_list, const char *cert_file,
 
             host_resolve("0.0.0.0", &ai);
             ai_addr_str(ai, addrstr, 256, 1);
-            int lfd = tls_socket_listen_accept(ai, port);
-
-            printf("listening %s:%d %d\n", addrstr, port, lfd);
+            tls_socket_listen_shards(ai, port, listen_current->workers, addrstr);
         }
 
         listen_current = listen_current->next;
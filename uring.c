@@ -0,0 +1,813 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    uring.c: io_uring event loop server
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include <pthread.h>
+
+#include "config.h"
+#include "log.h"
+#include "http.h"
+#include "socket_util.h"
+#include "slab.h"
+#include "cache.h"
+#include "mime.h"
+
+#include "uring.h"
+
+#define URING_ENTRIES   4096
+#define URING_BUFS      1024        /* provided receive buffers, power of 2 */
+#define URING_BUF_SIZE  16384
+#define URING_BGID      0
+#define URING_SEND_MAX  (1 << 30)   /* sqe->len is 32 bit */
+
+/* What a completion user_data refers to */
+typedef enum {
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_CLOSE,
+    URING_CANCEL,
+    URING_TIMEOUT
+} uring_op_type_t;
+
+typedef struct {
+    uring_op_type_t type;
+    uring_conn_t *conn;
+} uring_op_t;
+
+typedef struct uring_s {
+    int fd;
+    /* submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    /* completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* provided receive buffers */
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned short br_tail;
+    unsigned gen;   /* bumped on every submission */
+    /* open link chain, sqe of its last op */
+    uring_conn_t *chain;
+    struct io_uring_sqe *chain_sqe;
+    /* keep-alive expiry */
+    uring_op_t timeout_op;
+    struct __kernel_timespec timeout_ts;
+    uring_conn_t *idle_head;    /* least recently active first */
+    uring_conn_t *idle_tail;
+    slab_t *conns;
+} uring_t;
+
+typedef struct {
+    uring_op_t op;
+    int fd;
+} uring_listener_t;
+
+struct uring_conn_s {
+    uring_op_t recv_op;
+    uring_op_t close_op;
+    uring_t *ring;
+    client_t cs;
+    char addrstr[128];
+    int inflight;   /* ops that will still complete */
+    int sending;    /* sends in flight, next request waits for them */
+    int closing;
+    time_t last_active;
+    uring_conn_t *prev;
+    uring_conn_t *next;
+    char *pending;  /* received but not yet processed */
+    size_t pendlen;
+};
+
+typedef struct {
+    uring_op_t op;
+    struct msghdr msg;  /* sendmsg only */
+    struct iovec *iov;
+    CACHED_CONTENT **held;  /* mappings sent from, released on completion */
+    int nheld;
+    char data[];    /* copied payload, empty when sending from stable memory */
+} uring_send_t;
+
+/* Vars */
+fd_thread_node_t *uring_loop_list = NULL;
+
+static uring_t *rings = NULL;
+static int nrings = 0;
+
+static uring_op_t cancel_op = { URING_CANCEL, NULL };
+
+
+int
+uring_setup(uring_t *ring) {
+    struct io_uring_params p = { 0 };
+    p.flags = IORING_SETUP_CLAMP;
+
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return -1;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+        IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    /* Provided buffer ring, kernels without it lack multishot too */
+    ring->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED)
+        return -1;
+    struct io_uring_buf_reg reg = { 0 };
+    reg.ring_addr = (uintptr_t)ring->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+        &reg, 1) < 0)
+        return -1;
+
+    ring->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (!ring->bufs)
+        return -1;
+    for (int i = 0; i < URING_BUFS; i++) {
+        struct io_uring_buf *buf = &ring->br->bufs[i];
+        buf->addr = (uintptr_t)(ring->bufs + (size_t)i * URING_BUF_SIZE);
+        buf->len = URING_BUF_SIZE - 1; /* room for '\0' */
+        buf->bid = i;
+    }
+    ring->br_tail = URING_BUFS;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Submit queued sqes, optionally waiting for a completion */
+int
+uring_enter(uring_t *ring, unsigned wait) {
+    unsigned n = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    ring->chain = NULL;
+    ring->gen++;
+
+    int r;
+    do {
+        r = syscall(__NR_io_uring_enter, ring->fd, n, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+struct io_uring_sqe *
+uring_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        /* Full, flush */
+        uring_enter(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries)
+            return NULL;
+    }
+
+    unsigned idx = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    ring->chain = NULL;
+    return sqe;
+}
+
+/* Links are positional, an op is chained to its predecessor only if that
+   is the last queued sqe and belongs to the same connection */
+struct io_uring_sqe *
+uring_chain_sqe(uring_t *ring, uring_conn_t *conn) {
+    uring_conn_t *chain = ring->chain;
+    struct io_uring_sqe *prev = ring->chain_sqe;
+    unsigned gen = ring->gen;
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe)
+        return NULL;
+    /* unless a flush already submitted the predecessor */
+    if (chain == conn && gen == ring->gen)
+        prev->flags |= IOSQE_IO_LINK;
+    ring->chain = conn;
+    ring->chain_sqe = sqe;
+    return sqe;
+}
+
+void
+uring_buf_recycle(uring_t *ring, unsigned bid) {
+    struct io_uring_buf *buf =
+        &ring->br->bufs[ring->br_tail & (URING_BUFS - 1)];
+    buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE - 1;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Multishot recv came in 6.0, after the buffer ring, and older kernels
+   fail it with EINVAL: try one on a socket pair. 0 when it works */
+int
+uring_probe_recv(uring_t *ring) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe || write(sv[1], "", 1) != 1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = 0;
+
+    /* Still armed after the byte it got if multishot took, closing the
+       other end then finishes it. Reap up to the last completion so none
+       reaches the loop */
+    int supported = 0, more = 1;
+    while (more) {
+        if (uring_enter(ring, 1) < 0)
+            break;
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                uring_buf_recycle(ring,
+                    cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+            if (cqe->res > 0 && more)
+                supported = 1;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (sv[1] >= 0) {
+            close(sv[1]);
+            sv[1] = -1;
+        }
+    }
+    close(sv[0]);
+    if (sv[1] >= 0)
+        close(sv[1]);
+    if (!supported) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return 0;
+}
+
+void
+uring_idle_remove(uring_t *ring, uring_conn_t *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else if (ring->idle_head == conn) ring->idle_head = conn->next;
+    else return;
+    if (conn->next) conn->next->prev = conn->prev;
+    else ring->idle_tail = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+/* Move to the back of the idle list */
+void
+uring_idle_touch(uring_t *ring, uring_conn_t *conn) {
+    conn->last_active = time(NULL);
+    if (ring->idle_tail == conn)
+        return;
+    uring_idle_remove(ring, conn);
+    conn->prev = ring->idle_tail;
+    if (ring->idle_tail) ring->idle_tail->next = conn;
+    else ring->idle_head = conn;
+    ring->idle_tail = conn;
+}
+
+int
+uring_arm_timeout(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe)
+        return -1;
+    ring->timeout_op = (uring_op_t){ URING_TIMEOUT, NULL };
+    ring->timeout_ts.tv_sec = 1;
+    ring->timeout_ts.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&ring->timeout_ts;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)&ring->timeout_op;
+    return 0;
+}
+
+/* Close connections idle for longer than keepalive_timeout, or
+   STALL_TIMEOUT when keep-alive is off */
+void
+uring_on_timeout(uring_t *ring) {
+    int timeout = keepalive_timeout > 0 ? keepalive_timeout : STALL_TIMEOUT;
+    time_t now = time(NULL);
+    uring_conn_t *conn = ring->idle_head;
+    while (conn && now - conn->last_active >= timeout) {
+        uring_conn_t *next = conn->next;
+        /* Still sending is not idle */
+        if (!conn->sending) {
+            console_log(LOG_DBG, conn->addrstr, "Keep-alive timeout", NULL);
+            uring_close(conn);
+        }
+        conn = next;
+    }
+    uring_arm_timeout(ring);
+}
+
+int
+uring_arm_accept(uring_t *ring, uring_listener_t *listener) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t)&listener->op;
+    return 0;
+}
+
+int
+uring_arm_recv(uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(conn->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->cs.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t)&conn->recv_op;
+    conn->inflight++;
+    return 0;
+}
+
+void
+uring_conn_release(uring_conn_t *conn) {
+    if (conn->closing && conn->inflight == 0) {
+        free(conn->pending);
+        slab_free(conn);
+    }
+}
+
+/* Process held back requests once the previous responses are out */
+void
+uring_conn_drain(uring_conn_t *conn) {
+    if (conn->sending || conn->closing || conn->pendlen == 0)
+        return;
+
+    conn->pending[conn->pendlen] = '\0';
+    ssize_t used = http_process_buffer(&conn->cs, conn->pending,
+        conn->pendlen);
+    if (used < 0) {
+        uring_close(conn);
+        return;
+    }
+    memmove(conn->pending, conn->pending + used, conn->pendlen - used);
+    conn->pendlen -= used;
+}
+
+/* Received data, buff has room for a '\0' after len */
+void
+uring_conn_input(uring_conn_t *conn, char *buff, size_t len) {
+    /* Straight from the provided buffer when nothing is held back */
+    if (conn->pendlen == 0 && conn->sending == 0) {
+        buff[len] = '\0';
+        ssize_t used = http_process_buffer(&conn->cs, buff, len);
+        if (used < 0) {
+            uring_close(conn);
+            return;
+        }
+        buff += used;
+        len -= used;
+        if (len == 0)
+            return;
+    }
+
+    if (!conn->pending)
+        conn->pending = malloc(BUFF_SIZE);
+    if (!conn->pending) {
+        uring_close(conn);
+        return;
+    }
+    if (conn->pendlen + len > BUFF_SIZE - 1) {
+        http_too_large(&conn->cs);
+        uring_close(conn);
+        return;
+    }
+    memcpy(conn->pending + conn->pendlen, buff, len);
+    conn->pendlen += len;
+    uring_conn_drain(conn);
+}
+
+void
+uring_on_accept(uring_t *ring, uring_listener_t *listener,
+    const struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_arm_accept(ring, listener);
+
+    if (cqe->res < 0) {
+        char lfdstr[16];
+        snprintf(lfdstr, 16, "%d", listener->fd);
+        console_log(LOG_ERR, lfdstr, "Accepting client: ",
+            strerror(-cqe->res));
+        return;
+    }
+
+    uring_conn_t *conn = slab_alloc(ring->conns);
+    if (!conn) {
+        close(cqe->res);
+        return;
+    }
+    conn->recv_op = (uring_op_t){ URING_RECV, conn };
+    conn->close_op = (uring_op_t){ URING_CLOSE, conn };
+    conn->ring = ring;
+    conn->inflight = 0;
+    conn->sending = 0;
+    conn->closing = 0;
+    conn->prev = conn->next = NULL;
+    conn->pending = NULL;
+    conn->pendlen = 0;
+    cs_init(&conn->cs, cqe->res, NULL, conn->addrstr);
+    conn->cs.uring = conn;
+
+    /* Multishot accept gives no address */
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(struct sockaddr_storage);
+    conn->addrstr[0] = '\0';
+    if (getpeername(conn->cs.fd, (struct sockaddr*)&sa, &salen) == 0)
+        sa_addr_str((struct sockaddr*)&sa, conn->addrstr, 128);
+
+    console_log(LOG_DBG, conn->addrstr, "Accepted client", NULL);
+
+    if (uring_arm_recv(conn) < 0) {
+        close(conn->cs.fd);
+        slab_free(conn);
+        return;
+    }
+    uring_idle_touch(ring, conn);
+}
+
+void
+uring_on_recv(uring_t *ring, uring_conn_t *conn,
+    const struct io_uring_cqe *cqe)
+{
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more)
+        conn->inflight--;
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buff = ring->bufs + (size_t)bid * URING_BUF_SIZE;
+        if (!conn->closing) {
+            uring_idle_touch(ring, conn);
+            uring_conn_input(conn, buff, cqe->res);
+        }
+        uring_buf_recycle(ring, bid);
+        if (!more && !conn->closing)
+            uring_arm_recv(conn);
+    } else if (cqe->res == -ENOBUFS) {
+        /* Ran out of provided buffers, rearm once some are recycled */
+        if (!more && !conn->closing)
+            uring_arm_recv(conn);
+    } else if (!conn->closing) {
+        if (cqe->res == 0)
+            console_log(LOG_DBG, conn->addrstr, "Client disconnected", NULL);
+        else
+            console_log(LOG_ERR, conn->addrstr, "Error reading client: ",
+                strerror(-cqe->res));
+        uring_close(conn);
+    }
+
+    uring_conn_release(conn);
+}
+
+void
+uring_on_send(uring_t *ring, uring_send_t *send,
+    const struct io_uring_cqe *cqe)
+{
+    uring_conn_t *conn = send->op.conn;
+    for (int i = 0; i < send->nheld; i++)
+        cached_content_release(send->held[i]);
+    free(send);
+    conn->inflight--;
+    conn->sending--;
+
+    if (cqe->res < 0 && !conn->closing) {
+        if (cqe->res != -ECANCELED)
+            console_log(LOG_ERR, conn->addrstr, "Error sending: ",
+                strerror(-cqe->res));
+        uring_close(conn);
+    } else if (!conn->closing) {
+        uring_idle_touch(ring, conn);
+        uring_conn_drain(conn);
+    }
+
+    uring_conn_release(conn);
+}
+
+void
+uring_on_close(uring_conn_t *conn, const struct io_uring_cqe *cqe) {
+    /* A failed send breaks the chain, close by hand */
+    if (cqe->res == -ECANCELED)
+        close(conn->cs.fd);
+    conn->inflight--;
+    uring_conn_release(conn);
+}
+
+void *
+uring_loop(void *ptr) {
+    uring_t *ring = (uring_t*)ptr;
+    mime_thread_init();
+
+    while (1) {
+        /* One syscall submits everything queued by the last batch and waits
+           for the next one */
+        if (uring_enter(ring, 1) < 0 && errno != EBUSY) {
+            console_log(LOG_ERR, "\t", "Error entering io_uring: ",
+                strerror(errno));
+            return NULL;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const struct io_uring_cqe *cqe =
+                &ring->cqes[head & *ring->cq_mask];
+            uring_op_t *op = (uring_op_t*)(uintptr_t)cqe->user_data;
+
+            switch (op->type) {
+                case URING_ACCEPT:
+                    uring_on_accept(ring, (uring_listener_t*)op, cqe); break;
+                case URING_RECV:
+                    uring_on_recv(ring, op->conn, cqe); break;
+                case URING_SEND:
+                    uring_on_send(ring, (uring_send_t*)op, cqe); break;
+                case URING_CLOSE:
+                    uring_on_close(op->conn, cqe); break;
+                case URING_TIMEOUT:
+                    uring_on_timeout(ring); break;
+                case URING_CANCEL: break;
+            }
+
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Exports */
+
+int
+uring_loops_init(int n) {
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = 1;
+
+    rings = calloc(n, sizeof(uring_t));
+    for (int i = 0; i < n; i++) {
+        if (uring_setup(&rings[i]) < 0) {
+            printf("Error setting up io_uring: %s\n", strerror(errno));
+            return -1;
+        }
+        if (uring_probe_recv(&rings[i]) < 0) {
+            printf("Error probing io_uring multishot recv: %s\n",
+                strerror(errno));
+            return -1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        char slabname[32];
+        snprintf(slabname, 32, "uring loop %d conn", i);
+        rings[i].conns = slab_create(slabname, sizeof(uring_conn_t), 64);
+        if (!rings[i].conns) return -1;
+    }
+    nrings = n;
+
+    return n;
+}
+
+/* Listeners are armed before the loops run, shard as in event.c */
+int
+uring_add_listener(int lfd, int shard) {
+    if (nrings == 0) return -1;
+
+    uring_listener_t *listener = malloc(sizeof(uring_listener_t));
+    listener->op = (uring_op_t){ URING_ACCEPT, NULL };
+    listener->fd = lfd;
+
+    for (int i = 0; i < nrings; i++) {
+        if (shard >= 0 && i != shard % nrings)
+            continue;
+        if (uring_arm_accept(&rings[i], listener) < 0) {
+            printf("Error arming accept on io_uring\n");
+            return -1;
+        }
+    }
+
+    return lfd;
+}
+
+int
+uring_loops_start() {
+    for (int i = 0; i < nrings; i++) {
+        uring_arm_timeout(&rings[i]);
+
+        pthread_t loop_thread;
+        pthread_create(&loop_thread, NULL, uring_loop, &rings[i]);
+        fd_thread_list_push(&uring_loop_list, rings[i].fd, loop_thread);
+        thread_pin_cpu(loop_thread, i);
+    }
+
+    printf("started %d io_uring loops\n", nrings);
+
+    return nrings;
+}
+
+int
+uring_send(uring_conn_t *conn, const void *buf, size_t n, int copy) {
+    size_t off = 0;
+    do {
+        size_t len = n - off > URING_SEND_MAX ? URING_SEND_MAX : n - off;
+        uring_send_t *send = malloc(sizeof(uring_send_t) + (copy ? len : 0));
+        if (!send)
+            return -1;
+        send->op = (uring_op_t){ URING_SEND, conn };
+        send->nheld = 0;
+
+        const char *ptr = (const char*)buf + off;
+        if (copy) {
+            memcpy(send->data, ptr, len);
+            ptr = send->data;
+        }
+
+        struct io_uring_sqe *sqe = uring_chain_sqe(conn->ring, conn);
+        if (!sqe) {
+            free(send);
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->cs.fd;
+        sqe->addr = (uintptr_t)ptr;
+        sqe->len = len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = (uintptr_t)&send->op;
+        conn->inflight++;
+        conn->sending++;
+
+        off += len;
+    } while (off < n);
+
+    return n;
+}
+
+/* One sendmsg for a batch of responses. iovs pointing into buff are
+   rebased onto a copy, the rest reference stable memory or the held
+   mappings, which the send takes over on success */
+int
+uring_sendv(uring_conn_t *conn, const struct iovec *iov, int iovcnt,
+    const char *buff, size_t len, CACHED_CONTENT **held, int nheld)
+{
+    size_t total = 0;
+    uring_send_t *send = malloc(sizeof(uring_send_t) +
+        iovcnt * sizeof(struct iovec) + nheld * sizeof(CACHED_CONTENT*) +
+        len);
+    if (!send)
+        return -1;
+    send->op = (uring_op_t){ URING_SEND, conn };
+    send->iov = (struct iovec*)send->data;
+    send->held = (CACHED_CONTENT**)(send->iov + iovcnt);
+    send->nheld = 0;
+    char *copy = (char*)(send->held + nheld);
+    memcpy(copy, buff, len);
+
+    for (int i = 0; i < iovcnt; i++) {
+        const char *base = iov[i].iov_base;
+        if (base >= buff && base < buff + len)
+            base = copy + (base - buff);
+        send->iov[i].iov_base = (void*)base;
+        send->iov[i].iov_len = iov[i].iov_len;
+        total += iov[i].iov_len;
+    }
+    memset(&send->msg, 0, sizeof(struct msghdr));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = iovcnt;
+
+    struct io_uring_sqe *sqe = uring_chain_sqe(conn->ring, conn);
+    if (!sqe) {
+        free(send);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->cs.fd;
+    sqe->addr = (uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)&send->op;
+    conn->inflight++;
+    conn->sending++;
+    memcpy(send->held, held, nheld * sizeof(CACHED_CONTENT*));
+    send->nheld = nheld;
+
+    return total;
+}
+
+int
+uring_close(uring_conn_t *conn) {
+    uring_t *ring = conn->ring;
+    if (conn->closing)
+        return 0;
+    conn->closing = 1;
+    uring_idle_remove(ring, conn);
+
+    /* Closed after the sends it is chained to */
+    struct io_uring_sqe *sqe = uring_chain_sqe(ring, conn);
+    if (sqe) {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = conn->cs.fd;
+        sqe->user_data = (uintptr_t)&conn->close_op;
+        conn->inflight++;
+    } else {
+        close(conn->cs.fd);
+    }
+
+    /* The multishot recv holds the socket open until cancelled */
+    sqe = uring_sqe(ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t)&conn->recv_op;
+        sqe->user_data = (uintptr_t)&cancel_op;
+    }
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+
+    arfhttpd: Yet another HTTP server
+    Copyright (C) 2023 arf20 (Ángel Ruiz Fernandez)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "config.h"
+
+typedef struct uring_conn_s uring_conn_t;
+struct cached_content_s;
+
+extern fd_thread_node_t *uring_loop_list;
+
+int uring_loops_init(int n);
+int uring_add_listener(int lfd, int shard);
+int uring_loops_start();
+
+int uring_send(uring_conn_t *conn, const void *buf, size_t n, int copy);
+int uring_sendv(uring_conn_t *conn, const struct iovec *iov, int iovcnt,
+    const char *buff, size_t len, struct cached_content_s **held, int nheld);
+int uring_close(uring_conn_t *conn);
+
+#endif